@@ -0,0 +1,183 @@
+/**
+ * @file aesd-circular-buffer-lf.c
+ * @brief Lock-free single producer, multiple consumer variant of the circular buffer
+ *
+ * The producer publishes each entry like a seqlock, but per slot: the slot
+ * sequence is odd while it's being written, and tells which entry number
+ * the slot holds once it's even again.  Consumers read a slot and check its
+ * sequence didn't change (or move on to a newer entry) meanwhile.
+ */
+
+#ifdef __KERNEL__
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+#define lf_load_acquire(p) smp_load_acquire(p)
+#define lf_store_release(p, v) smp_store_release(p, v)
+#define lf_load(p) READ_ONCE(*(p))
+#define lf_store(p, v) WRITE_ONCE(*(p), v)
+#define lf_fence_acquire() smp_rmb()
+#define lf_fence_release() smp_wmb()
+#else
+#define lf_load_acquire(p) atomic_load_explicit(p, memory_order_acquire)
+#define lf_store_release(p, v) atomic_store_explicit(p, v, memory_order_release)
+#define lf_load(p) atomic_load_explicit(p, memory_order_relaxed)
+#define lf_store(p, v) atomic_store_explicit(p, v, memory_order_relaxed)
+#define lf_fence_acquire() atomic_thread_fence(memory_order_acquire)
+#define lf_fence_release() atomic_thread_fence(memory_order_release)
+#endif
+
+#include "aesd-circular-buffer-lf.h"
+
+/**
+ * Initializes @param buffer, no other thread may be using it
+ */
+void aesd_circular_buffer_lf_init(struct aesd_circular_buffer_lf *buffer)
+{
+    uint8_t i;
+    lf_store(&buffer->in_offs, 0);
+    lf_store(&buffer->out_offs, 0);
+    for(i=0; i<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+    {
+        lf_store(&buffer->slot[i].seq, 0);
+        lf_store(&buffer->slot[i].buffptr, NULL);
+        lf_store(&buffer->slot[i].size, 0);
+        lf_store(&buffer->slot[i].pos, 0);
+    }
+}
+
+/**
+* Adds entry @param add_entry to @param buffer, overwriting the oldest entry if it was full.
+* Must only be called by one thread at a time (the producer), consumers may run concurrently.
+* Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry overwritten, or NULL
+*/
+char *aesd_circular_buffer_lf_add_entry(struct aesd_circular_buffer_lf *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    // we are the only writer, no ordering needed to read our own stores
+    unsigned long in = lf_load(&buffer->in_offs);
+    struct aesd_circular_buffer_lf_slot *slot = &buffer->slot[in % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    unsigned long long pos = 0;
+    char *ret_value = NULL;
+
+    if(in)
+    {
+        struct aesd_circular_buffer_lf_slot *last = &buffer->slot[(in - 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        pos = lf_load(&last->pos) + lf_load(&last->size);
+    }
+    if(in >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        ret_value = lf_load(&slot->buffptr);
+        // consumers stop starting at the oldest entry before it's overwritten
+        lf_store_release(&buffer->out_offs, in - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1);
+    }
+    // odd: consumers reading this slot retry
+    lf_store(&slot->seq, 2 * in + 1);
+    lf_fence_release();
+    lf_store(&slot->buffptr, add_entry->buffptr);
+    lf_store(&slot->size, add_entry->size);
+    lf_store(&slot->pos, pos);
+    lf_store_release(&slot->seq, 2 * in + 2);
+    // publish
+    lf_store_release(&buffer->in_offs, in + 1);
+    return ret_value;
+}
+
+/**
+ * Copy entry number @param n out of its slot
+ * @return false if the slot doesn't (or no longer) hold that entry
+ */
+static bool aesd_circular_buffer_lf_read_slot(struct aesd_circular_buffer_lf *buffer, unsigned long n,
+            struct aesd_buffer_entry *entry, unsigned long long *pos)
+{
+    struct aesd_circular_buffer_lf_slot *slot = &buffer->slot[n % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    unsigned long seq = lf_load_acquire(&slot->seq);
+    if(seq != 2 * n + 2)
+        return false;
+    entry->buffptr = lf_load(&slot->buffptr);
+    entry->size = lf_load(&slot->size);
+    *pos = lf_load(&slot->pos);
+    // the copies above happen before checking the sequence again
+    lf_fence_acquire();
+    return lf_load(&slot->seq) == seq;
+}
+
+/**
+ * Consistent copy of every entry of @param buffer, oldest first
+ * Lock-free, may be called from any number of threads concurrently with the producer
+ * @param entries receives up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
+ * @param start is set to the position of the first byte of entries[0]
+ * @return the number of entries copied
+ */
+uint8_t aesd_circular_buffer_lf_snapshot(struct aesd_circular_buffer_lf *buffer,
+            struct aesd_buffer_entry *entries, unsigned long long *start)
+{
+    unsigned long in, n;
+    uint8_t count;
+    bool consistent;
+
+    do
+    {
+        in = lf_load_acquire(&buffer->in_offs);
+        n = in > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ? in - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+        *start = 0;
+        count = 0;
+        // the producer advances it before overwriting a slot: if it's past
+        // the oldest entry of `in`, that one is going away, look again
+        consistent = lf_load_acquire(&buffer->out_offs) <= n;
+        for(; consistent && n < in; n++)
+        {
+            unsigned long long pos;
+            if(!aesd_circular_buffer_lf_read_slot(buffer, n, &entries[count], &pos))
+            {
+                // overwritten while we looked, start over from the new oldest
+                consistent = false;
+                break;
+            }
+            if(!count)
+                *start = pos;
+            count++;
+        }
+    } while(!consistent);
+    return count;
+}
+
+/**
+ * @param buffer the buffer to search, lock-free
+ * @param char_offset the position to search for, counted from the first byte ever added
+ *      (entries evicted still count, see aesd_circular_buffer.base_offs)
+ * @param entry_rtn receives a copy of the entry holding char_offset
+ * @param entry_offset_byte_rtn receives the byte of entry_rtn->buffptr corresponding to char_offset
+ * @return true if found, false if this position is not available in the buffer
+ *      (evicted, or not enough data written)
+ */
+bool aesd_circular_buffer_lf_find_entry_offset_for_fpos(struct aesd_circular_buffer_lf *buffer,
+            unsigned long long char_offset, struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry entries[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    unsigned long long start;
+    uint8_t i, count = aesd_circular_buffer_lf_snapshot(buffer, entries, &start);
+
+    if(char_offset < start)
+        return false;
+    char_offset -= start;
+    for(i=0; i<count; i++)
+    {
+        if(char_offset < entries[i].size)
+        {
+            *entry_rtn = entries[i];
+            *entry_offset_byte_rtn = char_offset;
+            return true;
+        }
+        char_offset -= entries[i].size;
+    }
+    return false;
+}
+
+/**
+ * Number of entries stored in @param buffer, lock-free
+ */
+uint8_t aesd_circular_buffer_lf_count(struct aesd_circular_buffer_lf *buffer)
+{
+    unsigned long in = lf_load_acquire(&buffer->in_offs);
+    return in < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ? in : AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
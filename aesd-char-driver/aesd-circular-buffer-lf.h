@@ -0,0 +1,80 @@
+/*
+ * aesd-circular-buffer-lf.h
+ *
+ *  @brief Lock-free variant of aesd-circular-buffer.h
+ *
+ *  A single producer adds entries, overwriting the oldest one when full,
+ *  while any number of consumers look at the entries without taking a lock.
+ *  Usable both from the kernel and from user space (C11 atomics).
+ *
+ *  The ring only hands out consistent copies of the entry descriptors:
+ *  memory referenced by an evicted entry must not be freed while consumers
+ *  may still be using a copy of it (e.g. RCU in the kernel, or reference
+ *  counting), same as with the locked version.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_LF_H
+#define AESD_CIRCULAR_BUFFER_LF_H
+
+#include "aesd-circular-buffer.h"
+
+#ifdef __KERNEL__
+typedef unsigned long aesd_lf_index_t;
+typedef char *aesd_lf_ptr_t;
+typedef size_t aesd_lf_size_t;
+typedef unsigned long long aesd_lf_pos_t;
+#else
+#include <stdatomic.h>
+// every field shared with consumers is atomic, there are no data races
+typedef _Atomic unsigned long aesd_lf_index_t;
+typedef _Atomic(char *) aesd_lf_ptr_t;
+typedef _Atomic size_t aesd_lf_size_t;
+typedef _Atomic unsigned long long aesd_lf_pos_t;
+#endif
+
+struct aesd_circular_buffer_lf_slot
+{
+    /**
+     * 2*n+1 while entry number n is being stored in this slot, 2*n+2 once
+     * it's there (0 if it never held an entry)
+     */
+    aesd_lf_index_t seq;
+    aesd_lf_ptr_t buffptr;
+    aesd_lf_size_t size;
+    /**
+     * Position of the first byte of this entry, as in
+     * aesd_circular_buffer.base_offs
+     */
+    aesd_lf_pos_t pos;
+};
+
+struct aesd_circular_buffer_lf
+{
+    /**
+     * Number of entries ever added, the next one goes to
+     * slot[in_offs % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]
+     * Only written by the producer (release), read by consumers (acquire)
+     */
+    aesd_lf_index_t in_offs;
+    /**
+     * Number of the oldest entry still stored, advanced by the producer
+     * before it overwrites a slot (consumers seeing it ahead of
+     * in_offs - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED retry)
+     */
+    aesd_lf_index_t out_offs;
+    struct aesd_circular_buffer_lf_slot slot[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+extern void aesd_circular_buffer_lf_init(struct aesd_circular_buffer_lf *buffer);
+
+extern char *aesd_circular_buffer_lf_add_entry(struct aesd_circular_buffer_lf *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern uint8_t aesd_circular_buffer_lf_snapshot(struct aesd_circular_buffer_lf *buffer,
+            struct aesd_buffer_entry *entries, unsigned long long *start);
+
+extern bool aesd_circular_buffer_lf_find_entry_offset_for_fpos(struct aesd_circular_buffer_lf *buffer,
+            unsigned long long char_offset, struct aesd_buffer_entry *entry_rtn, size_t *entry_offset_byte_rtn);
+
+extern uint8_t aesd_circular_buffer_lf_count(struct aesd_circular_buffer_lf *buffer);
+
+#endif /* AESD_CIRCULAR_BUFFER_LF_H */
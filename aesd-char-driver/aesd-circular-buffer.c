@@ -83,13 +83,16 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* new start location, accounting the overwritten bytes in buffer->base_offs.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
 */
 char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
     char *ret_value = buffer->entry[buffer->in_offs].buffptr;
+    // the oldest entry is about to go away
+    if(buffer->full)
+        buffer->base_offs += buffer->entry[buffer->in_offs].size;
     // copy
     memcpy(buffer->entry+buffer->in_offs, add_entry, sizeof(struct aesd_buffer_entry));
     // increment
@@ -204,6 +207,20 @@ struct aesd_buffer_entry *aesd_circular_buffer_get_entry_no(struct aesd_circular
     return buffer->entry + read_offs;
 }
 
+/**
+* Gets the number of entries currently stored in @param buffer
+* Any necessary locking must be handled by the caller
+* @return the number of entries, starting at out_offs, which are in use
+*/
+uint8_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+    if(buffer->full)
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    // `in_offs` is never behind `out_offs` unless it rolled over
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+            % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
@@ -32,10 +32,10 @@ struct aesd_buffer_entry
 
 struct aesd_circular_buffer
 {
-    /**
-     * An array of pointers to memory allocated for the most recent write operations
+    /*
+     * Indices first: every lookup reads them, so they share the first
+     * cache line with the oldest entries instead of sitting after all of them
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
     /**
      * The current location in the entry structure where the next write should
      * be stored.
@@ -49,6 +49,15 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Total number of bytes evicted since init, that is, the position of
+     * the first byte at out_offs if all writes ever added were concatenated
+     */
+    unsigned long long base_offs;
+    /**
+     * An array of pointers to memory allocated for the most recent write operations
+     */
+    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -62,6 +71,8 @@ extern unsigned long long aesd_circular_buffer_len(struct aesd_circular_buffer *
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_get_entry_no(struct aesd_circular_buffer *buffer, int index, unsigned long long *entry_offset);
 
+extern uint8_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -38,9 +38,209 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Enable (non-zero) or disable (zero) tail-following on this open file.
+ * When enabled, a read at the end of the history blocks until the next write
+ * command is stored (or fails with EAGAIN for O_NONBLOCK files) instead of
+ * returning 0.
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+
+/**
+ * File positions on the aesdchar device are absolute: byte 0 is the first byte
+ * ever written, and a position keeps pointing at the same byte after older
+ * entries are evicted.  This structure describes where an open file stands.
+ */
+struct aesd_cursor {
+    /**
+     * Current file position
+     */
+    uint64_t pos;
+    /**
+     * Position of the oldest byte still stored
+     */
+    uint64_t start;
+    /**
+     * Position right after the newest byte stored
+     */
+    uint64_t end;
+    /**
+     * Bytes this file skipped because they were evicted before being read
+     */
+    uint64_t lost;
+};
+#define AESDCHAR_IOCGCURSOR _IOR(AESD_IOC_MAGIC, 3, struct aesd_cursor)
+
+/**
+ * One read of a batch, the same as AESDCHAR_IOCSEEKTO followed by read()
+ * but without moving the file position
+ */
+struct aesd_read_desc {
+    /**
+     * The zero referenced write command to start reading from
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * Maximum number of bytes to read, reads continue into the following
+     * write commands like read() does; at most INT32_MAX
+     */
+    uint32_t length;
+    /**
+     * Set by the driver: number of bytes read, or a negative errno
+     * (-EINVAL if the write command or offset doesn't exist, or if
+     * @ref length doesn't fit in the result)
+     */
+    int32_t result;
+    /**
+     * User space address to store the data at
+     */
+    uint64_t buf;
+};
+
+/**
+ * Maximum number of descriptors of one AESDCHAR_IOCBATCHREAD
+ */
+#define AESD_BATCH_READ_MAX 1024
+
+/**
+ * Argument of AESDCHAR_IOCBATCHREAD
+ */
+struct aesd_batch_read {
+    /**
+     * Number of elements at @ref descs, up to AESD_BATCH_READ_MAX
+     * (-EINVAL above it)
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * User space address of an array of struct aesd_read_desc
+     */
+    uint64_t descs;
+};
+// Fill every descriptor from a single consistent view of the buffer
+#define AESDCHAR_IOCBATCHREAD _IOW(AESD_IOC_MAGIC, 4, struct aesd_batch_read)
+/**
+ * Device statistics, counters are totals since the module was loaded
+ */
+struct aesd_stats {
+    /**
+     * Write commands currently stored, out of @ref capacity
+     */
+    uint32_t entries;
+    uint32_t capacity;
+    uint64_t bytes_stored;
+    uint64_t bytes_evicted;
+    /**
+     * Bytes of partial commands waiting for their newline
+     */
+    uint64_t bytes_pending;
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t writes;
+    uint64_t bytes_written;
+    /**
+     * Write commands stored, and how many older ones they overwrote
+     */
+    uint64_t commits;
+    uint64_t evictions;
+    /**
+     * Lock contention: lock-free lookups retried because of a concurrent
+     * write, and commits which found the device lock already taken
+     */
+    uint64_t read_retries;
+    uint64_t write_contended;
+};
+#define AESDCHAR_IOCGSTATS _IOR(AESD_IOC_MAGIC, 5, struct aesd_stats)
+
+/**
+ * Image of the stored write commands, to keep them across module reloads.
+ * The header is followed by @ref count write commands, oldest first, each
+ * one a uint32_t length and that many bytes.  Values are in host byte order.
+ */
+#define AESD_IMAGE_MAGIC 0x44534541 // "AESD"
+#define AESD_IMAGE_VERSION 1
+struct aesd_image_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    /**
+     * File position of the first byte of the first write command
+     * (see struct aesd_cursor), kept on import
+     */
+    uint64_t start;
+};
+
+/**
+ * Argument of AESDCHAR_IOCEXPORT and AESDCHAR_IOCIMPORT
+ */
+struct aesd_image {
+    /**
+     * User space address of the image
+     */
+    uint64_t buf;
+    /**
+     * Size of the buffer at @ref buf.  On export the driver sets it to the
+     * size of the image, and fails with ENOSPC if that didn't fit
+     */
+    uint64_t size;
+};
+// Write the stored write commands as an image (one consistent view)
+#define AESDCHAR_IOCEXPORT _IOWR(AESD_IOC_MAGIC, 6, struct aesd_image)
+// Replace the stored write commands with those of an image, the file must be open for writing
+#define AESDCHAR_IOCIMPORT _IOW(AESD_IOC_MAGIC, 7, struct aesd_image)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
+
+/**
+ * Number of entries described by the mmap header, must match
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED on the driver side
+ */
+#define AESD_MMAP_MAX_ENTRIES 10
+
+/**
+ * Location of one write command inside a read-only mmap of the device
+ */
+struct aesd_mmap_entry {
+    /**
+     * Byte offset of the entry contents from the start of the mapping,
+     * always a multiple of the page size
+     */
+    uint64_t offset;
+    /**
+     * Number of valid bytes at @ref offset
+     */
+    uint64_t size;
+};
+
+/**
+ * Contents of the first page of a read-only mmap of the aesdchar device.
+ * Entry contents follow on page aligned offsets, oldest entry first.
+ *
+ * The generation is odd while the driver updates the header and is bumped
+ * to the next even value after every write command.  Readers should load the
+ * generation, copy what they need (header and data) and load it again, retrying
+ * if it was odd or changed.  The driver unmaps the data pages of the previous
+ * layout before the generation becomes even again, so they fault in with the
+ * new contents; nothing has to be re-mapped.
+ */
+struct aesd_mmap_header {
+    uint64_t generation;
+    /**
+     * Number of valid elements in @ref entry
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * File position of the first byte of entry[0] (see struct aesd_cursor)
+     */
+    uint64_t start;
+    struct aesd_mmap_entry entry[AESD_MMAP_MAX_ENTRIES];
+};
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,181 @@
+/**
+ * aesdchar-image: save the write commands stored by an aesdchar device to a
+ * file, or load them back, so history survives a module reload
+ *
+ *  aesdchar-image save <device> <file>
+ *  aesdchar-image restore <device> <file>
+ *
+ * Used by aesdchar_unload and aesdchar_load
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "aesd_ioctl.h"
+
+static int save(const char *device, const char *path)
+{
+    struct aesd_image image = {0};
+    char *buf = NULL, *tmp_path;
+    int fd, out, ret = 1;
+    ssize_t written;
+    size_t done;
+
+    fd = open(device, O_RDONLY);
+    if(fd < 0)
+    {
+        perror(device);
+        return 1;
+    }
+    // ask for the size first, retry if a write made it grow meanwhile
+    while(ioctl(fd, AESDCHAR_IOCEXPORT, &image) < 0)
+    {
+        char *larger;
+        if(errno != ENOSPC)
+        {
+            perror("AESDCHAR_IOCEXPORT");
+            goto _close;
+        }
+        larger = realloc(buf, image.size);
+        if(!larger)
+        {
+            perror("realloc");
+            goto _close;
+        }
+        buf = larger;
+        image.buf = (uintptr_t)buf;
+    }
+
+    // replace the old image atomically
+    tmp_path = malloc(strlen(path) + 5);
+    if(!tmp_path)
+    {
+        perror("malloc");
+        goto _close;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    out = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if(out < 0)
+    {
+        perror(tmp_path);
+        goto _free;
+    }
+    for(done=0; done<image.size; done+=written)
+    {
+        written = write(out, buf + done, image.size - done);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                written = 0;
+                continue;
+            }
+            perror("write");
+            break;
+        }
+    }
+    if(done != image.size || fsync(out))
+    {
+        close(out);
+        unlink(tmp_path);
+        goto _free;
+    }
+    close(out);
+    if(rename(tmp_path, path))
+    {
+        perror("rename");
+        unlink(tmp_path);
+        goto _free;
+    }
+    ret = 0;
+_free:
+    free(tmp_path);
+_close:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+static int restore(const char *device, const char *path)
+{
+    struct aesd_image image = {0};
+    struct stat st;
+    char *buf;
+    int fd, in, ret = 1;
+    ssize_t nread;
+    size_t done;
+
+    in = open(path, O_RDONLY);
+    if(in < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    if(fstat(in, &st))
+    {
+        perror("fstat");
+        close(in);
+        return 1;
+    }
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if(!buf)
+    {
+        perror("malloc");
+        close(in);
+        return 1;
+    }
+    for(done=0; done<(size_t)st.st_size; done+=nread)
+    {
+        nread = read(in, buf + done, st.st_size - done);
+        if(nread < 0 && errno == EINTR)
+        {
+            nread = 0;
+            continue;
+        }
+        if(nread <= 0)
+            break;
+    }
+    close(in);
+    if(done != (size_t)st.st_size)
+    {
+        fprintf(stderr, "%s: short read\n", path);
+        goto _free;
+    }
+
+    fd = open(device, O_WRONLY);
+    if(fd < 0)
+    {
+        perror(device);
+        goto _free;
+    }
+    image.buf = (uintptr_t)buf;
+    image.size = done;
+    // one lock acquisition on the driver side
+    if(ioctl(fd, AESDCHAR_IOCIMPORT, &image) < 0)
+        perror("AESDCHAR_IOCIMPORT");
+    else
+        ret = 0;
+    close(fd);
+_free:
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 4)
+        goto _usage;
+    if(!strcmp(argv[1], "save"))
+        return save(argv[2], argv[3]);
+    if(!strcmp(argv[1], "restore"))
+        return restore(argv[2], argv[3]);
+_usage:
+    fprintf(stderr, "usage: %s save|restore <device> <file>\n", argv[0]);
+    return 1;
+}
@@ -8,23 +8,72 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
 #undef PDEBUG             /* undef it, just in case */
-#ifdef AESD_DEBUG
-#  ifdef __KERNEL__
-     /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
-#  else
-     /* This one for user space */
-#    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
-#  endif
+#ifdef __KERNEL__
+   /*
+      Kernel space goes through dynamic debug, nothing is printed until enabled with
+      echo 'module aesdchar +p' > /sys/kernel/debug/dynamic_debug/control
+      (without CONFIG_DYNAMIC_DEBUG, build with DEBUG=y to get them)
+   */
+#  define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt, ## args)
+#elif defined(AESD_DEBUG)
+   /* This one for user space */
+#  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
 #else
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/*
+    A write command stored in the circular buffer
+
+    Readers take a reference (under RCU) and copy without any lock
+    held, the memory is only released once the last reader is done
+    and a grace period has passed.
+*/
+struct aesd_record
+{
+    refcount_t ref;
+    struct rcu_head rcu;
+    // whole pages, see `aesd_mmap`
+    char *buffptr;
+    size_t size;
+};
+
+/*
+    Counters kept per CPU, so the hot paths never share a cache line
+    for them; summed on demand by AESDCHAR_IOCGSTATS and debugfs
+*/
+struct aesd_pcpu_stats
+{
+    u64 reads;
+    u64 bytes_read;
+    u64 writes;
+    u64 bytes_written;
+    u64 commits;
+    u64 evictions;
+    u64 read_retries;
+    u64 write_contended;
+    // bytes added to (or removed from) pending buffers on this CPU
+    s64 pending_bytes;
+};
+
+/*
+    References on consecutive records, taken in one lock-free pass
+*/
+struct aesd_snapshot
+{
+    struct aesd_record *records[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t count;
+    // zero referenced write command of records[0]
+    uint8_t index;
+    // file position of the first byte of records[0]
+    unsigned long long start;
+};
+
 struct aesd_dev
 {
     /*
@@ -37,14 +86,55 @@ struct aesd_dev
     /**
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
+    /*
+        Grouped by who touches them, each group on its own cache lines so
+        writers taking one lock don't evict what readers are looking at
+    */
+    // read-mostly, set once at init
+    // first page of a mmap, updated under lock (write side)
+    struct aesd_mmap_header *mmap_header;
+    // its i_mapping tracks every mmap of the device (filp->f_mapping)
+    struct inode *inode;
+    struct aesd_pcpu_stats __percpu *stats;
+
+    // every read and commit: writers lock, readers retry
+    seqlock_t lock ____cacheline_aligned_in_smp;
     // the circular buffer
     struct aesd_circular_buffer circular_buffer;
-    // for read write stuff
-    struct rw_semaphore semaphore;
+    // records backing each slot of circular_buffer (same index)
+    struct aesd_record *records[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    // header updates not published yet (see `aesd_mmap_update`)
+    unsigned int mmap_pending;
+
+    // mmap page faults, and commits while the device is mapped: zapping
+    // the previous layout waits for faults which may have looked it up
+    struct mutex mmap_mutex ____cacheline_aligned_in_smp;
+
+    // writers only: partial command left behind by a closed file
+    struct mutex orphan_mutex ____cacheline_aligned_in_smp;
+    struct aesd_buffer_entry orphan_entry;
+    size_t orphan_capacity;
+
+    // woken up on every write command, touched by sleeping readers
+    wait_queue_head_t readers_wait ____cacheline_aligned_in_smp;
+} ____cacheline_aligned_in_smp;
+
+/*
+    per open file state, stored in `filp->private_data`
+*/
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    // block at the end of the history instead of returning EOF
+    bool follow;
+    // bytes evicted before we got to read them
+    unsigned long long lost;
 
-    // save buffer
+    // pending (partial) command of this file
     struct aesd_buffer_entry buffer_entry;
-    struct mutex save_mutex;
+    // bytes allocated for buffer_entry (whole pages)
+    size_t buffer_capacity;
+    struct mutex write_mutex;
 };
 
 
@@ -0,0 +1,149 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints for the aesdchar driver
+ *
+ *  Entry and exit of each file operation, for latency histograms with
+ *  perf/ftrace, e.g.
+ *  echo 'hist:keys=dev:vals=lock_ns' > /sys/kernel/tracing/events/aesdchar/aesd_read_end/trigger
+ *  Disabled tracepoints cost a patched-out branch, lock wait times are only
+ *  measured while the matching *_end event is enabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_io_start,
+    TP_PROTO(unsigned int dev, size_t count, loff_t pos),
+    TP_ARGS(dev, count, pos),
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("dev=%u count=%zu pos=%lld", __entry->dev, __entry->count, __entry->pos)
+);
+
+DEFINE_EVENT(aesd_io_start, aesd_read_start,
+    TP_PROTO(unsigned int dev, size_t count, loff_t pos),
+    TP_ARGS(dev, count, pos)
+);
+
+DEFINE_EVENT(aesd_io_start, aesd_write_start,
+    TP_PROTO(unsigned int dev, size_t count, loff_t pos),
+    TP_ARGS(dev, count, pos)
+);
+
+/*
+    entry: zero referenced write command the read started at,
+    or number of write commands stored by the write
+*/
+DECLARE_EVENT_CLASS(aesd_io_end,
+    TP_PROTO(unsigned int dev, ssize_t ret, loff_t pos, int entry, u64 lock_ns),
+    TP_ARGS(dev, ret, pos, entry, lock_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(ssize_t, ret)
+        __field(loff_t, pos)
+        __field(int, entry)
+        __field(u64, lock_ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->ret = ret;
+        __entry->pos = pos;
+        __entry->entry = entry;
+        __entry->lock_ns = lock_ns;
+    ),
+    TP_printk("dev=%u ret=%zd pos=%lld entry=%d lock_ns=%llu",
+        __entry->dev, __entry->ret, __entry->pos, __entry->entry, __entry->lock_ns)
+);
+
+DEFINE_EVENT(aesd_io_end, aesd_read_end,
+    TP_PROTO(unsigned int dev, ssize_t ret, loff_t pos, int entry, u64 lock_ns),
+    TP_ARGS(dev, ret, pos, entry, lock_ns)
+);
+
+DEFINE_EVENT(aesd_io_end, aesd_write_end,
+    TP_PROTO(unsigned int dev, ssize_t ret, loff_t pos, int entry, u64 lock_ns),
+    TP_ARGS(dev, ret, pos, entry, lock_ns)
+);
+
+TRACE_EVENT(aesd_llseek_start,
+    TP_PROTO(unsigned int dev, loff_t offset, int whence),
+    TP_ARGS(dev, offset, whence),
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(loff_t, offset)
+        __field(int, whence)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->offset = offset;
+        __entry->whence = whence;
+    ),
+    TP_printk("dev=%u offset=%lld whence=%d", __entry->dev, __entry->offset, __entry->whence)
+);
+
+TRACE_EVENT(aesd_llseek_end,
+    TP_PROTO(unsigned int dev, loff_t ret),
+    TP_ARGS(dev, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev=%u ret=%lld", __entry->dev, __entry->ret)
+);
+
+TRACE_EVENT(aesd_ioctl_start,
+    TP_PROTO(unsigned int dev, unsigned int cmd),
+    TP_ARGS(dev, cmd),
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(unsigned int, cmd)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->cmd = cmd;
+    ),
+    TP_printk("dev=%u cmd=%u", __entry->dev, _IOC_NR(__entry->cmd))
+);
+
+TRACE_EVENT(aesd_ioctl_end,
+    TP_PROTO(unsigned int dev, unsigned int cmd, long ret),
+    TP_ARGS(dev, cmd, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, dev)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev=%u cmd=%u ret=%ld", __entry->dev, _IOC_NR(__entry->cmd), __entry->ret)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
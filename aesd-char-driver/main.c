@@ -17,11 +17,32 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
-#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h> // fatal_signal_pending
+#include <linux/moduleparam.h>
+#include <linux/uio.h>
+#include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/timekeeping.h> // ktime_get_ns
+#include <linux/mount.h>
+#include <linux/pseudo_fs.h> // init_pseudo
+#include <linux/kernel.h> // min
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -29,64 +50,460 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Tiago Teixeira"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+// one independent ring per minor (aesdchar0..N-1)
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(num_devices, "Number of aesdchar devices to create");
+
+struct aesd_dev *aesd_devices;
+
+// /sys/kernel/debug/aesdchar
+static struct dentry *aesd_debugfs;
+
+/*
+    Internal filesystem holding an inode per device: its mapping is where
+    every mmap of the device is tracked, whichever device node was opened
+    (see `aesd_mmap_publish`)
+*/
+#define AESD_FS_MAGIC 0x41455344 // "AESD"
+static struct vfsmount *aesd_fs_mnt;
+static int aesd_fs_count;
+
+/**
+ * @return the index (minor, from aesd_minor) of @param dev, for tracing
+ */
+static unsigned int aesd_index(struct aesd_dev *dev)
+{
+    return dev - aesd_devices;
+}
+
+/**
+ * read_seqretry on the device lock, counting retries in the statistics
+ */
+static bool aesd_read_retry(struct aesd_dev *dev, unsigned int seq)
+{
+    if(!read_seqretry(&dev->lock, seq))
+        return false;
+    this_cpu_inc(dev->stats->read_retries);
+    return true;
+}
+
+/*
+    Entries are stored in whole pages (`alloc_pages_exact`) so they
+    can be handed to user space as-is on mmap.
+    Each page is refcounted on its own, a page still mapped somewhere
+    outlives the entry it was freed with.
+*/
+static void aesd_record_free_rcu(struct rcu_head *head)
+{
+    struct aesd_record *record = container_of(head, struct aesd_record, rcu);
+    free_pages_exact(record->buffptr, record->size);
+    kfree(record);
+}
+
+static void aesd_record_put(struct aesd_record *record)
+{
+    // lock-free readers may still be looking at it
+    if(record && refcount_dec_and_test(&record->ref))
+        call_rcu(&record->rcu, aesd_record_free_rcu);
+}
+
+/**
+ * Clear the last page of @param record past its size, before it's stored:
+ * pages aren't zeroed when allocated (or hold what a pending buffer had
+ * there) and mmap hands the whole page out
+ */
+static void aesd_record_clear_tail(struct aesd_record *record)
+{
+    memset(record->buffptr + record->size, 0, PAGE_ALIGN(record->size) - record->size);
+}
+
+/**
+ * Take a reference on every record from the one holding file position
+ * @param pos to the newest, in a single lock-free pass (retries while a
+ * writer is updating the circular buffer)
+ * If @param pos was evicted, the snapshot starts at the oldest record
+ * Release with `aesd_snapshot_put`
+ */
+static void aesd_snapshot_get(struct aesd_dev *dev, unsigned long long pos, struct aesd_snapshot *snap)
+{
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    unsigned int seq;
+    uint8_t i, count, read_offs;
+
+    rcu_read_lock();
+    do
+    {
+        do
+        {
+            seq = read_seqbegin(&dev->lock);
+            snap->count = 0;
+            snap->index = 0;
+            snap->start = buffer->base_offs;
+            count = aesd_circular_buffer_count(buffer);
+            read_offs = buffer->out_offs;
+            for(i=0; i<count; i++)
+            {
+                size_t size = buffer->entry[read_offs].size;
+                if(!snap->count && snap->start + size <= pos)
+                {
+                    // fully before pos
+                    snap->start += size;
+                    snap->index++;
+                }
+                else
+                    snap->records[snap->count++] = dev->records[read_offs];
+                read_offs++;
+                if(read_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+                    read_offs = 0;
+            }
+        } while(aesd_read_retry(dev, seq));
+        // pin them, a zero count means one was evicted just now
+        for(i=0; i<snap->count; i++)
+            if(!refcount_inc_not_zero(&snap->records[i]->ref))
+                break;
+        if(i == snap->count)
+            break;
+        // look again
+        while(i--)
+            aesd_record_put(snap->records[i]);
+    } while(true);
+    rcu_read_unlock();
+}
+
+static void aesd_snapshot_put(struct aesd_snapshot *snap)
+{
+    uint8_t i;
+    for(i=0; i<snap->count; i++)
+        aesd_record_put(snap->records[i]);
+}
+
+/**
+ * Oldest (@param start) and end (@param end) file positions stored
+ * Lock-free, the values are consistent with each other
+ */
+static void aesd_get_range(struct aesd_dev *dev, unsigned long long *start, unsigned long long *end)
+{
+    unsigned int seq;
+    do
+    {
+        seq = read_seqbegin(&dev->lock);
+        *start = dev->circular_buffer.base_offs;
+        *end = *start + aesd_circular_buffer_len(&dev->circular_buffer);
+    } while(aesd_read_retry(dev, seq));
+}
+
+/**
+ * Refresh the mmap header page after the circular buffer changed, its
+ * generation stays odd until every pending `aesd_mmap_publish` is done
+ * Caller must hold the write side of dev->lock
+ */
+static void aesd_mmap_update(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    uint64_t offset = PAGE_SIZE;    // data starts after the header page
+    uint8_t i, read_offs = buffer->out_offs;
+    uint8_t count = aesd_circular_buffer_count(buffer);
+
+    // odd while the header or the mapped pages are out of date (readers
+    // retry), and different after every update
+    WRITE_ONCE(header->generation, header->generation + (dev->mmap_pending++ ? 2 : 1));
+    smp_wmb();
+    for(i=0; i<count; i++)
+    {
+        header->entry[i].offset = offset;
+        header->entry[i].size = buffer->entry[read_offs].size;
+        offset += PAGE_ALIGN(buffer->entry[read_offs].size);
+        read_offs++;
+        if(read_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+            read_offs = 0;
+    }
+    header->count = count;
+    header->start = buffer->base_offs;
+}
+
+/**
+ * Drop the data pages mapped with the previous layout, then mark the
+ * header consistent again (even generation) unless another update is pending
+ * Called after `aesd_mmap_update`, without dev->lock held (zapping sleeps)
+ */
+static void aesd_mmap_publish(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    struct address_space *mapping = dev->inode->i_mapping;
+
+    // the update before looking for mappings (pairs with `aesd_vm_fault`):
+    // one made after this faults the new layout in
+    smp_mb();
+    if(mapping_mapped(mapping))
+    {
+        // after the faults in progress, which may map the old layout
+        mutex_lock(&dev->mmap_mutex);
+        // everything after the header page, in every mapping of the device
+        unmap_mapping_range(mapping, PAGE_SIZE, 0, 1);
+        mutex_unlock(&dev->mmap_mutex);
+    }
+    // the header only, lock-free readers of the buffer don't retry
+    read_seqlock_excl(&dev->lock);
+    if(!--dev->mmap_pending)
+    {
+        smp_wmb();
+        WRITE_ONCE(header->generation, header->generation + 1);
+    }
+    read_sequnlock_excl(&dev->lock);
+}
+
+/**
+ * Store @param count new records in the circular buffer, under a single
+ * acquisition of the device lock, and publish them to mmap users
+ * The circular buffer takes over the reference held on each record
+ * @param lock_ns is incremented by the time spent acquiring the lock,
+ *  only measured while the aesd_write_end tracepoint is enabled
+ */
+static void aesd_commit_records(struct aesd_dev *dev, struct aesd_record **records, uint8_t count, u64 *lock_ns)
+{
+    struct aesd_record *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t i, nevicted = 0;
+    u64 t0 = trace_aesd_write_end_enabled() ? ktime_get_ns() : 0;
+
+    // the only device wide lock on the write path (readers will retry),
+    // unless the device is mapped
+    if(spin_is_locked(&dev->lock.lock))
+        this_cpu_inc(dev->stats->write_contended);
+    write_seqlock(&dev->lock);
+    if(t0)
+        *lock_ns += ktime_get_ns() - t0;
+    for(i=0; i<count; i++)
+    {
+        struct aesd_buffer_entry entry = {
+            .buffptr = records[i]->buffptr,
+            .size = records[i]->size,
+        };
+        uint8_t slot = dev->circular_buffer.in_offs;
+        if(aesd_circular_buffer_add_entry(&dev->circular_buffer, &entry))
+            // the entry we just overwrote
+            evicted[nevicted++] = dev->records[slot];
+        dev->records[slot] = records[i];
+    }
+    aesd_mmap_update(dev);
+    write_sequnlock(&dev->lock);
+    aesd_mmap_publish(dev);
+    this_cpu_add(dev->stats->commits, count);
+    this_cpu_add(dev->stats->evictions, nevicted);
+    // new data for tail-following readers and pollers
+    wake_up_interruptible(&dev->readers_wait);
+    // free previous (once readers are done with them)
+    for(i=0; i<nevicted; i++)
+        aesd_record_put(evicted[i]);
+}
+
+/**
+ * Current generation of the circular buffer, changes on every write command
+ * Can be called without any lock held
+ */
+static uint64_t aesd_generation(struct aesd_dev *dev)
+{
+    return READ_ONCE(dev->mmap_header->generation);
+}
+
+/**
+ * @return true if there is data to read at @param pos
+ */
+static bool aesd_has_data(struct aesd_dev *dev, loff_t pos)
+{
+    unsigned long long start, end;
+    aesd_get_range(dev, &start, &end);
+    return pos < end;
+}
+
+/**
+ * Make room for @param count more bytes in the pending buffer @param entry
+ * Buffers grow in whole pages, so they can be committed as is
+ * @param capacity holds the bytes allocated for @param entry
+ * @return 0 on success, -ENOMEM if the buffer couldn't grow (it is left untouched)
+ */
+static int aesd_pending_reserve(struct aesd_buffer_entry *entry, size_t *capacity, size_t count)
+{
+    size_t needed = entry->size + count;
+    char *buffptr;
+    if(needed <= *capacity)
+        return 0;
+    buffptr = alloc_pages_exact(PAGE_ALIGN(needed), GFP_KERNEL);
+    if(!buffptr)
+        return -ENOMEM;
+    //PDEBUG("write buffer is at %p, prev was %p", buffptr, entry->buffptr);
+    if(entry->buffptr)
+    {
+        // copy first portion
+        memcpy(buffptr, entry->buffptr, entry->size);
+        // free previous
+        free_pages_exact(entry->buffptr, *capacity);
+    }
+    entry->buffptr = buffptr;
+    *capacity = PAGE_ALIGN(needed);
+    return 0;
+}
+
+/*
+    Pending (partial) commands belong to the file writing them, so
+    concurrent writers don't mix their lines.
+    A partial command still pending when its file is closed is parked
+    on the device and picked up by the next write, the same as if the
+    buffer was shared (`echo -n abc > /dev/aesdchar; echo def > ...`).
+*/
+static void aesd_park_orphan(struct aesd_file *fd)
+{
+    struct aesd_dev *dev = fd->dev;
+    mutex_lock(&dev->orphan_mutex);
+    if(!dev->orphan_entry.buffptr)
+    {
+        // just hand it over
+        dev->orphan_entry = fd->buffer_entry;
+        dev->orphan_capacity = fd->buffer_capacity;
+    }
+    else
+    {
+        if(!aesd_pending_reserve(&dev->orphan_entry, &dev->orphan_capacity, fd->buffer_entry.size))
+        {
+            memcpy(dev->orphan_entry.buffptr + dev->orphan_entry.size, fd->buffer_entry.buffptr, fd->buffer_entry.size);
+            dev->orphan_entry.size += fd->buffer_entry.size;
+        }
+        else
+        {
+            PDEBUG("dropping %zu pending bytes", fd->buffer_entry.size);
+            this_cpu_sub(dev->stats->pending_bytes, fd->buffer_entry.size);
+        }
+        free_pages_exact(fd->buffer_entry.buffptr, fd->buffer_capacity);
+    }
+    mutex_unlock(&dev->orphan_mutex);
+    fd->buffer_entry.buffptr = NULL;
+    fd->buffer_entry.size = 0;
+    fd->buffer_capacity = 0;
+}
+
+/**
+ * Take the parked partial command (if any) as the pending buffer of @param fd
+ * The pending buffer of @param fd must be empty
+ */
+static void aesd_adopt_orphan(struct aesd_file *fd)
+{
+    struct aesd_dev *dev = fd->dev;
+    mutex_lock(&dev->orphan_mutex);
+    fd->buffer_entry = dev->orphan_entry;
+    fd->buffer_capacity = dev->orphan_capacity;
+    dev->orphan_entry.buffptr = NULL;
+    dev->orphan_entry.size = 0;
+    dev->orphan_capacity = 0;
+    mutex_unlock(&dev->orphan_mutex);
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *fd;
     PDEBUG("open");
     /**
      * TODO: handle open
      */
-    filp->private_data = inode->i_cdev;
+    fd = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if(!fd)
+        return -ENOMEM;
+    // cdev is the first member of aesd_dev
+    fd->dev = (struct aesd_dev*)inode->i_cdev;
+    mutex_init(&fd->write_mutex);
+    filp->private_data = fd;
+    // mappings from every device node in one place, see `aesd_mmap_publish`
+    filp->f_mapping = fd->dev->inode->i_mapping;
+    // start at the oldest data still around
+    filp->f_pos = READ_ONCE(fd->dev->circular_buffer.base_offs);
     // all good then
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *fd = (struct aesd_file*)filp->private_data;
     PDEBUG("release");
     /**
      * TODO: handle release
      */
-    // nothing to release
+    if(fd->buffer_entry.buffptr)
+    {
+        if(fd->buffer_entry.size)
+            aesd_park_orphan(fd);
+        else
+            free_pages_exact(fd->buffer_entry.buffptr, fd->buffer_capacity);
+    }
+    kfree(fd);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),iocb->ki_pos);
     /**
      * TODO: handle read
      */
     size_t total_read = 0,
-           entry_offset = 0,
-           space_left = count;
-    size_t read_offset = (size_t)*f_pos;
-    struct aesd_buffer_entry *buffer_entry;
-    struct aesd_dev *aesd_dev = (struct aesd_dev*)filp->private_data;
-    // acquire read semaphore
-    down_read(&aesd_dev->semaphore);
-    // while space_left > 0
-    while(space_left > 0)
-    {
-        //PDEBUG("got %d space left", space_left);
-        // if find_entry_for_offset == NULL -> return total_read
-        if((buffer_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&aesd_dev->circular_buffer, read_offset, &entry_offset)) == NULL)
-            // EOF
+           entry_offset;
+    unsigned long long read_offset = (unsigned long long)iocb->ki_pos;
+    struct aesd_snapshot snap;
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *fd = (struct aesd_file*)filp->private_data;
+    struct aesd_dev *aesd_dev = fd->dev;
+    ssize_t retval;
+    u64 t0, lock_ns = 0;
+    uint8_t i;
+    trace_aesd_read_start(aesd_index(aesd_dev), iov_iter_count(to), iocb->ki_pos);
+    snap.index = 0;
+    if(!iov_iter_count(to))
+    {
+        retval = 0;
+        goto _end;
+    }
+    // tail-following readers wait for the next write command instead of EOF
+    while(fd->follow)
+    {
+        uint64_t generation = aesd_generation(aesd_dev);
+        // read generation before checking, so we don't miss a wake-up
+        smp_rmb();
+        if(aesd_has_data(aesd_dev, read_offset))
             break;
-        // else
-        // copy to user (min(space_left, size))
-        //PDEBUG("buffer entry is at %p: (%d) %s", buffer_entry, buffer_entry->size, buffer_entry->buffptr);
-        size_t left_in_entry = buffer_entry->size - entry_offset;
-        size_t to_copy = space_left > left_in_entry ? left_in_entry : space_left;
-        //PDEBUG("copying %d bytes to user", to_copy);
-        size_t copied = to_copy - copy_to_user(buf + total_read, buffer_entry->buffptr + entry_offset, to_copy);
-        // total_read += ?
+        if((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+        {
+            retval = -EAGAIN;
+            goto _end;
+        }
+        if(wait_event_interruptible(aesd_dev->readers_wait, aesd_generation(aesd_dev) != generation))
+        {
+            retval = -ERESTARTSYS;
+            goto _end;
+        }
+    }
+    // no lock held while copying, the references keep the records around
+    // (copying to user space may fault and sleep)
+    t0 = trace_aesd_read_end_enabled() ? ktime_get_ns() : 0;
+    aesd_snapshot_get(aesd_dev, read_offset, &snap);
+    if(t0)
+        lock_ns = ktime_get_ns() - t0;
+    // positions are absolute, anything before the oldest byte was evicted
+    if(snap.count && read_offset < snap.start)
+    {
+        PDEBUG("lost %llu bytes before offset %llu", snap.start - read_offset, snap.start);
+        fd->lost += snap.start - read_offset;
+        read_offset = snap.start;
+    }
+    entry_offset = read_offset - snap.start;
+    // fill as many iovecs as we can, from as many entries as needed
+    for(i=0; i<snap.count && iov_iter_count(to); i++)
+    {
+        struct aesd_record *record = snap.records[i];
+        size_t left_in_entry = record->size - entry_offset;
+        size_t to_copy = min(left_in_entry, iov_iter_count(to));
+        size_t copied = copy_to_iter(record->buffptr + entry_offset, to_copy, to);
         total_read += copied;
         read_offset += copied;
-        // space_left -= read
-        space_left -= copied;
+        entry_offset = 0;
         if(copied != to_copy)
         {
             // failed to copy full data to user,
@@ -95,85 +512,160 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
             break;
         }
     }
-    // release semaphore
-    up_read(&aesd_dev->semaphore);
-    *f_pos = (loff_t)read_offset;
-    return (ssize_t)total_read;
+    aesd_snapshot_put(&snap);
+    this_cpu_inc(aesd_dev->stats->reads);
+    this_cpu_add(aesd_dev->stats->bytes_read, total_read);
+    iocb->ki_pos = (loff_t)read_offset;
+    retval = (ssize_t)total_read;
+_end:
+    trace_aesd_read_end(aesd_index(aesd_dev), retval, iocb->ki_pos, snap.index, lock_ns);
+    return retval;
+}
+
+/**
+ * Move every complete command in the pending buffer of @param fd into the
+ * circular buffer, batching them to take the device lock as little as possible
+ * What's left after the last '\n' stays pending
+ * @param err is set to a negative error code if not every command could be stored
+ * @param commits is set to the number of commands stored
+ * @param lock_ns see `aesd_commit_records`
+ * @return the number of bytes committed
+ */
+static size_t aesd_commit_pending(struct aesd_file *fd, int *err, int *commits, u64 *lock_ns)
+{
+    struct aesd_buffer_entry *pending = &fd->buffer_entry;
+    struct aesd_record *batch[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t nbatch = 0;
+    size_t done = 0;
+    char *newline;
+
+    *err = 0;
+    *commits = 0;
+    while(pending->buffptr && (newline = memchr(pending->buffptr + done, '\n', pending->size - done)) != NULL)
+    {
+        size_t len = newline + 1 - (pending->buffptr + done);
+        struct aesd_record *record = kmalloc(sizeof(struct aesd_record), GFP_KERNEL);
+        if(!record)
+        {
+            *err = -ENOMEM;
+            break;
+        }
+        if(done == 0 && len == pending->size)
+        {
+            // the usual case, a single command: hand the pages over
+            size_t used = PAGE_ALIGN(len);
+            if(fd->buffer_capacity > used)
+                free_pages_exact(pending->buffptr + used, fd->buffer_capacity - used);
+            record->buffptr = pending->buffptr;
+            pending->buffptr = NULL;
+            pending->size = 0;
+            fd->buffer_capacity = 0;
+        }
+        else
+        {
+            record->buffptr = alloc_pages_exact(len, GFP_KERNEL);
+            if(!record->buffptr)
+            {
+                kfree(record);
+                *err = -ENOMEM;
+                break;
+            }
+            memcpy(record->buffptr, pending->buffptr + done, len);
+        }
+        // the circular buffer will hold this reference
+        refcount_set(&record->ref, 1);
+        record->size = len;
+        aesd_record_clear_tail(record);
+        batch[nbatch++] = record;
+        (*commits)++;
+        done += len;
+        if(nbatch == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        {
+            aesd_commit_records(fd->dev, batch, nbatch, lock_ns);
+            nbatch = 0;
+        }
+    }
+    if(nbatch)
+        aesd_commit_records(fd->dev, batch, nbatch, lock_ns);
+    this_cpu_sub(fd->dev->stats->pending_bytes, done);
+    // keep the partial command at the start of the buffer
+    if(pending->buffptr && done)
+    {
+        pending->size -= done;
+        if(pending->size)
+            memmove(pending->buffptr, pending->buffptr + done, pending->size);
+        else
+        {
+            free_pages_exact(pending->buffptr, fd->buffer_capacity);
+            pending->buffptr = NULL;
+            fd->buffer_capacity = 0;
+        }
+    }
+    return done;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     ssize_t retval = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+    size_t count = iov_iter_count(from);
+    int err, commits = 0;
+    u64 t0, lock_ns = 0;
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
     /**
      * TODO: handle write
      */
-    struct aesd_dev *aesd_dev = (struct aesd_dev*)filp->private_data;
-    if(mutex_lock_interruptible(&aesd_dev->save_mutex))
-        return -EINTR;
-    // append to buffer
-    {
-        // save previous
-        char *prev = aesd_dev->buffer_entry.buffptr;
-        // kmalloc with added size
-        aesd_dev->buffer_entry.buffptr = kmalloc(aesd_dev->buffer_entry.size + count, GFP_KERNEL);
-        if(!aesd_dev->buffer_entry.buffptr)
-        {
-            aesd_dev->buffer_entry.buffptr = prev;    // restore for `release` operation
-            mutex_unlock(&aesd_dev->save_mutex);
-            return -ENOMEM;
-        }
-        //PDEBUG("write buffer is at %p, prev was %p", fd->buffer_entry.buffptr, prev);
-        if(prev)
-        {
-            // copy first portion
-            memcpy(aesd_dev->buffer_entry.buffptr, prev, aesd_dev->buffer_entry.size);
-            // free previous
-            kfree(prev);
-        }
-        // append new data (return number of bytes copied)
-        retval = count - copy_from_user(aesd_dev->buffer_entry.buffptr+aesd_dev->buffer_entry.size, buf, count);
-        aesd_dev->buffer_entry.size += retval;
+    struct aesd_file *fd = (struct aesd_file*)iocb->ki_filp->private_data;
+    struct aesd_dev *aesd_dev = fd->dev;
+    trace_aesd_write_start(aesd_index(aesd_dev), count, iocb->ki_pos);
+    // only serializes users of this same file (threads, dup, fork)
+    t0 = trace_aesd_write_end_enabled() ? ktime_get_ns() : 0;
+    if(mutex_lock_interruptible(&fd->write_mutex))
+    {
+        retval = -EINTR;
+        goto _end;
     }
-    // check for '\n'
+    if(t0)
+        lock_ns = ktime_get_ns() - t0;
+    // continue a partial command from a file already closed
+    if(!fd->buffer_entry.buffptr && READ_ONCE(aesd_dev->orphan_entry.buffptr))
+        aesd_adopt_orphan(fd);
+    // append to buffer (all segments at once)
+    if(aesd_pending_reserve(&fd->buffer_entry, &fd->buffer_capacity, count))
     {
-        char *newline = memchr(aesd_dev->buffer_entry.buffptr, '\n', aesd_dev->buffer_entry.size);
-        if(!newline)
-            goto _ret;
-        // else, write to circular_buffer
-        // (assume '\n' is the final character)
-        if((newline+1-aesd_dev->buffer_entry.buffptr) != aesd_dev->buffer_entry.size)
-            PDEBUG("there are characters after command terminator (newline)");
-        aesd_dev->buffer_entry.size = newline + 1 - aesd_dev->buffer_entry.buffptr;
-        // acquire semaphore to write
-        down_write(&aesd_dev->semaphore);
-        // write
-        char *prev_buffer = aesd_circular_buffer_add_entry(&aesd_dev->circular_buffer, &aesd_dev->buffer_entry);
-        // release
-        up_write(&aesd_dev->semaphore);
-        // free previous
-        if(prev_buffer) kfree(prev_buffer);
-        // clean it after copy
-        aesd_dev->buffer_entry.buffptr = NULL;
-        aesd_dev->buffer_entry.size = 0;
+        // previous one is left for `release` operation
+        retval = -ENOMEM;
+        goto _ret;
+    }
+    // append new data (return number of bytes copied)
+    retval = copy_from_iter(fd->buffer_entry.buffptr+fd->buffer_entry.size, count, from);
+    fd->buffer_entry.size += retval;
+    this_cpu_inc(aesd_dev->stats->writes);
+    this_cpu_add(aesd_dev->stats->bytes_written, retval);
+    this_cpu_add(aesd_dev->stats->pending_bytes, retval);
+    // store every complete command
+    if(!aesd_commit_pending(fd, &err, &commits, &lock_ns) && err)
+    {
+        // drop what we just appended, as if this write never happened
+        fd->buffer_entry.size -= retval;
+        this_cpu_sub(aesd_dev->stats->pending_bytes, retval);
+        retval = err;
     }
+    // else, commands not stored are retried on the next write
 _ret:
-    mutex_unlock(&aesd_dev->save_mutex);
+    mutex_unlock(&fd->write_mutex);
+_end:
+    trace_aesd_write_end(aesd_index(aesd_dev), retval, iocb->ki_pos, commits, lock_ns);
     return retval;
 }
 
-loff_t aesd_llseek(struct file * filp, loff_t offset, int whence)
+static loff_t aesd_do_llseek(struct file * filp, loff_t offset, int whence)
 {
     loff_t newpos = 0, buffer_size;
-    struct aesd_dev *aesd_dev = (struct aesd_dev*)filp->private_data;
-    // don't allow writes while we calculate stuff
-    /*
-        none of the functions we use here block
-        (at the time of writing, at least, good luck in the future)
-    */
-    down_read(&aesd_dev->semaphore);
-    buffer_size = aesd_circular_buffer_len(&aesd_dev->circular_buffer);
+    unsigned long long start, end;
+    struct aesd_dev *aesd_dev = ((struct aesd_file*)filp->private_data)->dev;
+    // positions are absolute, see struct aesd_cursor
+    aesd_get_range(aesd_dev, &start, &end);
+    buffer_size = (loff_t)end;
     switch(whence)
     {
         case SEEK_SET:
@@ -186,29 +678,330 @@ loff_t aesd_llseek(struct file * filp, loff_t offset, int whence)
             newpos = buffer_size + offset;
             break;
         default:
-            newpos = -EINVAL;
-            goto _end;
+            return -EINVAL;
     }
     // don't allow overshoot (aswell as negative offset)
+    // evicted positions are fine, reading from there reports the loss
     if(newpos < 0 || newpos > buffer_size)
-    {
-        newpos = -EINVAL;
-        goto _end;
-    }
+        return -EINVAL;
     // set it
     filp->f_pos = newpos;
-_end:
-    up_read(&aesd_dev->semaphore);
     return newpos;
 }
 
-long aesd_u_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_dev *aesd_dev = ((struct aesd_file*)filp->private_data)->dev;
+    // writes are never held back
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &aesd_dev->readers_wait, wait);
+    if(aesd_has_data(aesd_dev, filp->f_pos))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+/**
+ * Fill @param stats with the counters of @param dev summed over all CPUs
+ * and the current occupancy of the circular buffer
+ */
+static void aesd_get_stats(struct aesd_dev *dev, struct aesd_stats *stats)
+{
+    unsigned long long start, end;
+    unsigned int seq;
+    int cpu;
+    s64 pending = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    do
+    {
+        seq = read_seqbegin(&dev->lock);
+        stats->entries = aesd_circular_buffer_count(&dev->circular_buffer);
+        start = dev->circular_buffer.base_offs;
+        end = start + aesd_circular_buffer_len(&dev->circular_buffer);
+    } while(read_seqretry(&dev->lock, seq));
+    stats->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    stats->bytes_stored = end - start;
+    stats->bytes_evicted = start;
+    for_each_possible_cpu(cpu)
+    {
+        struct aesd_pcpu_stats *pcpu = per_cpu_ptr(dev->stats, cpu);
+        stats->reads += pcpu->reads;
+        stats->bytes_read += pcpu->bytes_read;
+        stats->writes += pcpu->writes;
+        stats->bytes_written += pcpu->bytes_written;
+        stats->commits += pcpu->commits;
+        stats->evictions += pcpu->evictions;
+        stats->read_retries += pcpu->read_retries;
+        stats->write_contended += pcpu->write_contended;
+        // per-CPU deltas, only the sum makes sense
+        pending += pcpu->pending_bytes;
+    }
+    stats->bytes_pending = pending > 0 ? pending : 0;
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats stats;
+    aesd_get_stats((struct aesd_dev*)s->private, &stats);
+    seq_printf(s, "entries: %u/%u\n", stats.entries, stats.capacity);
+    seq_printf(s, "bytes_stored: %llu\n", stats.bytes_stored);
+    seq_printf(s, "bytes_evicted: %llu\n", stats.bytes_evicted);
+    seq_printf(s, "bytes_pending: %llu\n", stats.bytes_pending);
+    seq_printf(s, "reads: %llu\n", stats.reads);
+    seq_printf(s, "bytes_read: %llu\n", stats.bytes_read);
+    seq_printf(s, "writes: %llu\n", stats.writes);
+    seq_printf(s, "bytes_written: %llu\n", stats.bytes_written);
+    seq_printf(s, "commits: %llu\n", stats.commits);
+    seq_printf(s, "evictions: %llu\n", stats.evictions);
+    seq_printf(s, "read_retries: %llu\n", stats.read_retries);
+    seq_printf(s, "write_contended: %llu\n", stats.write_contended);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+/**
+ * Serve every descriptor of @param batch from one snapshot of the buffer
+ * Write commands are indexed directly, no walk per descriptor
+ * @return 0, -EINVAL if there are too many descriptors, -EINTR if the
+ *  caller got a fatal signal, or -EFAULT if the descriptors couldn't be accessed
+ */
+static long aesd_batch_read(struct aesd_dev *dev, struct aesd_batch_read *batch)
+{
+    struct aesd_read_desc __user *udescs = u64_to_user_ptr(batch->descs);
+    struct aesd_snapshot snap;
+    long retval = 0;
+    uint32_t i;
+
+    if(batch->count > AESD_BATCH_READ_MAX)
+        return -EINVAL;
+    // every record (from position 0 on, that's all of them)
+    aesd_snapshot_get(dev, 0, &snap);
+    for(i=0; i<batch->count; i++)
+    {
+        struct aesd_read_desc desc;
+        char __user *buf;
+        size_t entry_offset, space_left;
+        uint8_t entry;
+        // only references are held, a long batch can give the CPU away
+        if(fatal_signal_pending(current))
+        {
+            retval = -EINTR;
+            break;
+        }
+        cond_resched();
+        if(copy_from_user(&desc, udescs + i, sizeof(desc)))
+        {
+            retval = -EFAULT;
+            break;
+        }
+        // result must be able to hold it
+        if(desc.length > INT_MAX || desc.write_cmd >= snap.count
+                || desc.write_cmd_offset >= snap.records[desc.write_cmd]->size)
+        {
+            desc.result = -EINVAL;
+            goto _next;
+        }
+        buf = u64_to_user_ptr(desc.buf);
+        space_left = desc.length;
+        entry_offset = desc.write_cmd_offset;
+        desc.result = 0;
+        for(entry=desc.write_cmd; entry<snap.count && space_left; entry++)
+        {
+            struct aesd_record *record = snap.records[entry];
+            size_t to_copy = min(record->size - entry_offset, space_left);
+            size_t copied = to_copy - copy_to_user(buf + desc.result, record->buffptr + entry_offset, to_copy);
+            desc.result += copied;
+            space_left -= copied;
+            entry_offset = 0;
+            if(copied != to_copy)
+            {
+                // same as read(), report what we have (or the fault)
+                if(!desc.result)
+                    desc.result = -EFAULT;
+                break;
+            }
+        }
+_next:
+        if(put_user(desc.result, &udescs[i].result))
+        {
+            retval = -EFAULT;
+            break;
+        }
+    }
+    aesd_snapshot_put(&snap);
+    return retval;
+}
+
+/**
+ * Write every stored record to user space as an image (struct aesd_image_header
+ * and the length-prefixed records), from one snapshot of the buffer
+ * @param image->size is set to the size of the whole image
+ * @return 0, -ENOSPC if it didn't fit in @param image->size bytes, or -EFAULT
+ */
+static long aesd_export(struct aesd_dev *dev, struct aesd_image *image)
+{
+    char __user *buf = u64_to_user_ptr(image->buf);
+    struct aesd_image_header header;
+    struct aesd_snapshot snap;
+    uint64_t size = sizeof(header);
+    long retval = 0;
+    uint8_t i;
+
+    aesd_snapshot_get(dev, 0, &snap);
+    for(i=0; i<snap.count; i++)
+    {
+        if(snap.records[i]->size > U32_MAX)
+        {
+            // can't be described by the length prefix
+            retval = -EOVERFLOW;
+            goto _ret;
+        }
+        size += sizeof(uint32_t) + snap.records[i]->size;
+    }
+    if(size > image->size)
+    {
+        retval = -ENOSPC;
+        goto _ret;
+    }
+    header.magic = AESD_IMAGE_MAGIC;
+    header.version = AESD_IMAGE_VERSION;
+    header.count = snap.count;
+    header.start = snap.start;
+    if(copy_to_user(buf, &header, sizeof(header)))
+    {
+        retval = -EFAULT;
+        goto _ret;
+    }
+    buf += sizeof(header);
+    for(i=0; i<snap.count; i++)
+    {
+        uint32_t len = snap.records[i]->size;
+        if(copy_to_user(buf, &len, sizeof(len)) || copy_to_user(buf + sizeof(len), snap.records[i]->buffptr, len))
+        {
+            retval = -EFAULT;
+            goto _ret;
+        }
+        buf += sizeof(len) + len;
+    }
+_ret:
+    image->size = size;
+    aesd_snapshot_put(&snap);
+    return retval;
+}
+
+/**
+ * Replace the contents of the circular buffer with the records of an image
+ * made by `aesd_export`, keeping its file positions
+ * The image is checked and copied in first, then swapped in under a single
+ * acquisition of the device lock
+ * @return 0, -EINVAL for a malformed image, -EFAULT or -ENOMEM
+ */
+static long aesd_import(struct aesd_dev *dev, struct aesd_image *image)
+{
+    const char __user *buf = u64_to_user_ptr(image->buf);
+    struct aesd_record *records[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_record *previous[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_image_header header;
+    uint64_t offset = sizeof(header);
+    long retval = 0;
+    uint8_t i, count;
+
+    if(image->size < sizeof(header))
+        return -EINVAL;
+    if(copy_from_user(&header, buf, sizeof(header)))
+        return -EFAULT;
+    if(header.magic != AESD_IMAGE_MAGIC || header.version != AESD_IMAGE_VERSION
+        || header.count > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        return -EINVAL;
+    for(count=0; count<header.count; count++)
+    {
+        struct aesd_record *record;
+        uint32_t len;
+        if(image->size - offset < sizeof(len))
+        {
+            retval = -EINVAL;
+            goto _err;
+        }
+        if(copy_from_user(&len, buf + offset, sizeof(len)))
+        {
+            retval = -EFAULT;
+            goto _err;
+        }
+        offset += sizeof(len);
+        if(!len || image->size - offset < len)
+        {
+            retval = -EINVAL;
+            goto _err;
+        }
+        record = kmalloc(sizeof(struct aesd_record), GFP_KERNEL);
+        if(!record)
+        {
+            retval = -ENOMEM;
+            goto _err;
+        }
+        record->buffptr = alloc_pages_exact(len, GFP_KERNEL);
+        if(!record->buffptr)
+        {
+            kfree(record);
+            retval = -ENOMEM;
+            goto _err;
+        }
+        if(copy_from_user(record->buffptr, buf + offset, len))
+        {
+            free_pages_exact(record->buffptr, len);
+            kfree(record);
+            retval = -EFAULT;
+            goto _err;
+        }
+        refcount_set(&record->ref, 1);
+        record->size = len;
+        aesd_record_clear_tail(record);
+        records[count] = record;
+        offset += len;
+    }
+
+    write_seqlock(&dev->lock);
+    memcpy(previous, dev->records, sizeof(previous));
+    memset(dev->records, 0, sizeof(dev->records));
+    aesd_circular_buffer_init(&dev->circular_buffer);
+    dev->circular_buffer.base_offs = header.start;
+    for(i=0; i<count; i++)
+    {
+        struct aesd_buffer_entry entry = {
+            .buffptr = records[i]->buffptr,
+            .size = records[i]->size,
+        };
+        // empty buffer, slots are filled from 0
+        aesd_circular_buffer_add_entry(&dev->circular_buffer, &entry);
+        dev->records[i] = records[i];
+    }
+    aesd_mmap_update(dev);
+    write_sequnlock(&dev->lock);
+    aesd_mmap_publish(dev);
+    wake_up_interruptible(&dev->readers_wait);
+    for(i=0; i<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+        aesd_record_put(previous[i]);
+    return 0;
+
+_err:
+    // not shared with anyone yet
+    while(count--)
+    {
+        free_pages_exact(records[count]->buffptr, records[count]->size);
+        kfree(records[count]);
+    }
+    return retval;
+}
+
+static long aesd_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct aesd_seekto req;
     struct aesd_buffer_entry *entry;
-    struct aesd_dev *aesd_dev = (struct aesd_dev*)filp->private_data;
+    struct aesd_dev *aesd_dev = ((struct aesd_file*)filp->private_data)->dev;
     loff_t newpos;
     unsigned long long entry_offset;
+    unsigned int seq;
 
     PDEBUG("ioctl command: %d, %d", _IOC_TYPE(cmd), _IOC_NR(cmd));
 
@@ -222,21 +1015,79 @@ long aesd_u_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             if(copy_from_user(&req, (void*)arg, sizeof(req)))
                 // couldn't read all
                 return -EINVAL;
-            // don't allow writes while we update this
-            down_read(&aesd_dev->semaphore);
-            entry = aesd_circular_buffer_get_entry_no(&aesd_dev->circular_buffer, req.write_cmd, &entry_offset);
-            if(!entry || req.write_cmd_offset >= entry->size)
+            // retry if a write happened while we looked
+            do
             {
-                up_read(&aesd_dev->semaphore);
+                seq = read_seqbegin(&aesd_dev->lock);
+                newpos = -EINVAL;
+                entry = aesd_circular_buffer_get_entry_no(&aesd_dev->circular_buffer, req.write_cmd, &entry_offset);
+                if(entry && req.write_cmd_offset < entry->size)
+                    newpos = (loff_t)(aesd_dev->circular_buffer.base_offs + entry_offset + req.write_cmd_offset);
+            } while(aesd_read_retry(aesd_dev, seq));
+            if(newpos < 0)
                 return -EINVAL;
-            }
-            newpos = (loff_t)(entry_offset + req.write_cmd_offset);
             // set it
             filp->f_pos = newpos;
-            up_read(&aesd_dev->semaphore);
             // return normally
         }
         break;
+        case AESDCHAR_IOCFOLLOW:
+        {
+            uint32_t follow;
+            if(copy_from_user(&follow, (void*)arg, sizeof(follow)))
+                return -EFAULT;
+            ((struct aesd_file*)filp->private_data)->follow = follow != 0;
+        }
+        break;
+        case AESDCHAR_IOCGCURSOR:
+        {
+            struct aesd_cursor cursor;
+            unsigned long long start, end;
+            cursor.pos = filp->f_pos;
+            aesd_get_range(aesd_dev, &start, &end);
+            cursor.start = start;
+            cursor.end = end;
+            cursor.lost = ((struct aesd_file*)filp->private_data)->lost;
+            if(copy_to_user((void*)arg, &cursor, sizeof(cursor)))
+                return -EFAULT;
+        }
+        break;
+        case AESDCHAR_IOCBATCHREAD:
+        {
+            struct aesd_batch_read batch;
+            if(copy_from_user(&batch, (void*)arg, sizeof(batch)))
+                return -EFAULT;
+            return aesd_batch_read(aesd_dev, &batch);
+        }
+        case AESDCHAR_IOCGSTATS:
+        {
+            struct aesd_stats stats;
+            aesd_get_stats(aesd_dev, &stats);
+            if(copy_to_user((void*)arg, &stats, sizeof(stats)))
+                return -EFAULT;
+        }
+        break;
+        case AESDCHAR_IOCEXPORT:
+        {
+            struct aesd_image image;
+            long retval;
+            if(copy_from_user(&image, (void*)arg, sizeof(image)))
+                return -EFAULT;
+            retval = aesd_export(aesd_dev, &image);
+            // the size is reported even when it didn't fit
+            if(put_user(image.size, &((struct aesd_image __user*)arg)->size))
+                return -EFAULT;
+            return retval;
+        }
+        case AESDCHAR_IOCIMPORT:
+        {
+            struct aesd_image image;
+            if(!(filp->f_mode & FMODE_WRITE))
+                return -EBADF;
+            if(copy_from_user(&image, (void*)arg, sizeof(image)))
+                return -EFAULT;
+            return aesd_import(aesd_dev, &image);
+        }
         default:
             return -ENOTTY;
     }
@@ -244,73 +1095,307 @@ long aesd_u_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return 0;
 }
 
+loff_t aesd_llseek(struct file * filp, loff_t offset, int whence)
+{
+    unsigned int index = aesd_index(((struct aesd_file*)filp->private_data)->dev);
+    loff_t ret;
+    trace_aesd_llseek_start(index, offset, whence);
+    ret = aesd_do_llseek(filp, offset, whence);
+    trace_aesd_llseek_end(index, ret);
+    return ret;
+}
+
+long aesd_u_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    unsigned int index = aesd_index(((struct aesd_file*)filp->private_data)->dev);
+    long ret;
+    trace_aesd_ioctl_start(index, cmd);
+    ret = aesd_do_ioctl(filp, cmd, arg);
+    trace_aesd_ioctl_end(index, cmd, ret);
+    return ret;
+}
+
+/*
+    Data pages are inserted under dev->mmap_mutex, so a commit zapping the
+    previous layout waits for a fault which may have looked it up
+*/
+static vm_fault_t aesd_vm_fault(struct vm_fault *vmf)
+{
+    struct aesd_dev *aesd_dev = (struct aesd_dev*)vmf->vma->vm_private_data;
+    struct aesd_circular_buffer *buffer = &aesd_dev->circular_buffer;
+    struct aesd_record *record;
+    struct page *page = NULL;
+    unsigned long pgoff;
+    unsigned int seq;
+    uint8_t i, count, read_offs;
+    int err;
+
+    if(vmf->pgoff == 0)
+    {
+        page = virt_to_page(aesd_dev->mmap_header);
+        get_page(page);
+        vmf->page = page;
+        return 0;
+    }
+
+    mutex_lock(&aesd_dev->mmap_mutex);
+    // the mapping is there, commits from now on will zap it (pairs with
+    // `aesd_mmap_publish`)
+    smp_mb();
+    // data pages, in the same order as the header describes them
+    rcu_read_lock();
+    do
+    {
+        do
+        {
+            seq = read_seqbegin(&aesd_dev->lock);
+            record = NULL;
+            pgoff = vmf->pgoff - 1;
+            count = aesd_circular_buffer_count(buffer);
+            read_offs = buffer->out_offs;
+            for(i=0; i<count; i++)
+            {
+                unsigned long npages = PAGE_ALIGN(buffer->entry[read_offs].size) >> PAGE_SHIFT;
+                if(pgoff < npages)
+                {
+                    record = aesd_dev->records[read_offs];
+                    break;
+                }
+                pgoff -= npages;
+                read_offs++;
+                if(read_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+                    read_offs = 0;
+            }
+        } while(aesd_read_retry(aesd_dev, seq));
+    } while(record && !refcount_inc_not_zero(&record->ref));
+    rcu_read_unlock();
+
+    if(!record)
+    {
+        mutex_unlock(&aesd_dev->mmap_mutex);
+        // past the end of the history
+        return VM_FAULT_SIGBUS;
+    }
+    // the mapping holds its own reference, the page outlives the record
+    page = virt_to_page(record->buffptr + (pgoff << PAGE_SHIFT));
+    err = vm_insert_page(vmf->vma, vmf->address & PAGE_MASK, page);
+    mutex_unlock(&aesd_dev->mmap_mutex);
+    aesd_record_put(record);
+    // -EBUSY: another thread mapped it first
+    if(err && err != -EBUSY)
+        return vmf_error(err);
+    return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .fault =    aesd_vm_fault,
+};
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    PDEBUG("mmap %lu pages at page offset %lu", vma_pages(vma), vma->vm_pgoff);
+    // history is read-only
+    if(vma->vm_flags & VM_WRITE)
+        return -EACCES;
+    // data pages are inserted by `aesd_vm_fault`
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_mod(vma, VM_MIXEDMAP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_MIXEDMAP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &aesd_vm_ops;
+    vma->vm_private_data = ((struct aesd_file*)filp->private_data)->dev;
+    return 0;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .llseek =   aesd_llseek,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    .splice_read =  copy_splice_read,
+#else
+    .splice_read =  generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .unlocked_ioctl = aesd_u_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+static int aesd_fs_init_fs_context(struct fs_context *fc)
+{
+    return init_pseudo(fc, AESD_FS_MAGIC) ? 0 : -ENOMEM;
+}
+
+static struct file_system_type aesd_fs_type = {
+    .name =     "aesdchar",
+    .owner =    THIS_MODULE,
+    .init_fs_context = aesd_fs_init_fs_context,
+    .kill_sb =  kill_anon_super,
+};
+
+/**
+ * @return a new inode of the internal filesystem, or an ERR_PTR
+ * Release with `aesd_fs_inode_put`
+ */
+static struct inode *aesd_fs_inode_new(void)
+{
+    struct inode *inode;
+    int result = simple_pin_fs(&aesd_fs_type, &aesd_fs_mnt, &aesd_fs_count);
+    if(result)
+        return ERR_PTR(result);
+    inode = alloc_anon_inode(aesd_fs_mnt->mnt_sb);
+    if(IS_ERR(inode))
+        simple_release_fs(&aesd_fs_mnt, &aesd_fs_count);
+    return inode;
+}
+
+static void aesd_fs_inode_put(struct inode *inode)
+{
+    iput(inode);
+    simple_release_fs(&aesd_fs_mnt, &aesd_fs_count);
+}
+
+static int aesd_init_device(struct aesd_dev *dev, int index)
+{
+    int result;
+    char name[16];
+    /**
+     * TODO: initialize the AESD specific portion of the device
+     */
+    seqlock_init(&dev->lock);
+    mutex_init(&dev->mmap_mutex);
+    mutex_init(&dev->orphan_mutex);
+    init_waitqueue_head(&dev->readers_wait);
+
+    dev->stats = alloc_percpu(struct aesd_pcpu_stats);
+    if(!dev->stats)
+        return -ENOMEM;
+    dev->mmap_header = (struct aesd_mmap_header*)get_zeroed_page(GFP_KERNEL);
+    if(!dev->mmap_header)
+    {
+        free_percpu(dev->stats);
+        return -ENOMEM;
+    }
+    dev->inode = aesd_fs_inode_new();
+    if(IS_ERR(dev->inode))
+    {
+        free_page((unsigned long)dev->mmap_header);
+        free_percpu(dev->stats);
+        return PTR_ERR(dev->inode);
+    }
+
+    result = aesd_setup_cdev(dev, index);
+    if(result)
+    {
+        aesd_fs_inode_put(dev->inode);
+        free_page((unsigned long)dev->mmap_header);
+        free_percpu(dev->stats);
+        return result;
+    }
+    // debugfs is optional, errors are not checked on purpose
+    snprintf(name, sizeof(name), "aesdchar%d", index);
+    debugfs_create_file(name, 0444, aesd_debugfs, dev, &aesd_stats_fops);
+    return 0;
+}
+
+static void aesd_cleanup_device(struct aesd_dev *dev)
+{
+    uint8_t index;
+
+    cdev_del(&dev->cdev);
 
+    /**
+     * TODO: cleanup AESD specific poritions here as necessary
+     */
+    if(dev->orphan_entry.buffptr)
+        free_pages_exact(dev->orphan_entry.buffptr, dev->orphan_capacity);
+    for(index=0; index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++)
+        aesd_record_put(dev->records[index]);
+    // pages still mapped by someone are released on their munmap
+    free_page((unsigned long)dev->mmap_header);
+    aesd_fs_inode_put(dev->inode);
+    free_percpu(dev->stats);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    unsigned int i;
+
+    BUILD_BUG_ON(AESD_MMAP_MAX_ENTRIES != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    BUILD_BUG_ON(sizeof(struct aesd_mmap_header) > PAGE_SIZE);
+
+    if(num_devices == 0)
+        return -EINVAL;
+    result = alloc_chrdev_region(&dev, aesd_minor, num_devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
-
-    /**
-     * TODO: initialize the AESD specific portion of the device
-     */
-    init_rwsem(&aesd_device.semaphore);
-    mutex_init(&aesd_device.save_mutex);
-
-    result = aesd_setup_cdev(&aesd_device);
+    // struct aesd_dev is cacheline aligned, devices don't share lines
+    aesd_devices = kcalloc(num_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if(!aesd_devices)
+    {
+        unregister_chrdev_region(dev, num_devices);
+        return -ENOMEM;
+    }
+    aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    for(i=0; i<num_devices; i++)
+    {
+        result = aesd_init_device(aesd_devices + i, i);
+        if(result)
+        {
+            // undo the ones already up
+            while(i--)
+                aesd_cleanup_device(aesd_devices + i);
+            debugfs_remove_recursive(aesd_debugfs);
+            kfree(aesd_devices);
+            unregister_chrdev_region(dev, num_devices);
+            return result;
+        }
     }
-    return result;
+    return 0;
 
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    /**
-     * TODO: cleanup AESD specific poritions here as necessary
-     */
-    if(aesd_device.buffer_entry.buffptr)
-        kfree(aesd_device.buffer_entry.buffptr);
+    // no more readers of the statistics
+    debugfs_remove_recursive(aesd_debugfs);
+    for(i=0; i<num_devices; i++)
+        aesd_cleanup_device(aesd_devices + i);
+    // wait for the frees queued above
+    rcu_barrier();
+    kfree(aesd_devices);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, num_devices);
 }
 
 
@@ -0,0 +1,182 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief ns/op of the aesd-circular-buffer.c functions used on the driver hot paths
+ *
+ * Each function is timed for several fill levels (the number of entries
+ * stored, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED being the full, wrapped
+ * around, ring), entry sizes and access patterns.  Results are printed as
+ * CSV, one line per case:
+ *
+ *  op,entries,entry_size,pattern,iterations,ns_per_op
+ *
+ * usage: aesd-circular-buffer-bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define DEFAULT_ITERATIONS 2000000
+// precomputed random inputs, so the RNG isn't timed
+#define NRANDOM 4096
+
+enum pattern
+{
+    // first byte / first entry
+    PATTERN_HEAD,
+    // last byte / last entry
+    PATTERN_TAIL,
+    // walk every byte in order, as consecutive reads do
+    PATTERN_SEQUENTIAL,
+    PATTERN_RANDOM,
+};
+
+static const char *pattern_names[] = {"head", "tail", "sequential", "random"};
+static const uint8_t fills[] = {1, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED / 2, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED};
+static const size_t entry_sizes[] = {16, 512, 65536};
+
+static char data[65536];
+static unsigned long long random_values[NRANDOM];
+// keeps results alive so the calls aren't optimized away
+static volatile unsigned long long sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *op, uint8_t entries, size_t entry_size, const char *pattern, unsigned long iterations, double ns)
+{
+    printf("%s,%u,%zu,%s,%lu,%.2f\n", op, entries, entry_size, pattern, iterations, ns / iterations);
+}
+
+/**
+ * Leave @param buffer with @param fill entries of @param entry_size bytes,
+ * after wrapping around at least once so out_offs isn't 0
+ */
+static void fill_buffer(struct aesd_circular_buffer *buffer, uint8_t fill, size_t entry_size)
+{
+    struct aesd_buffer_entry entry = {.buffptr = data, .size = entry_size};
+    uint8_t i;
+    aesd_circular_buffer_init(buffer);
+    for(i=0; i<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++)
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    // drop the oldest ones, as if they were never there
+    buffer->full = fill == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->out_offs = (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - fill) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+static void bench_add_entry(unsigned long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    size_t s;
+    for(s=0; s<sizeof(entry_sizes)/sizeof(entry_sizes[0]); s++)
+    {
+        struct aesd_buffer_entry entry = {.buffptr = data, .size = entry_sizes[s]};
+        unsigned long i;
+        double t0;
+        // steady state of the driver: full, every add evicts
+        fill_buffer(&buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, entry_sizes[s]);
+        t0 = now_ns();
+        for(i=0; i<iterations; i++)
+            sink += (unsigned long long)(uintptr_t)aesd_circular_buffer_add_entry(&buffer, &entry);
+        report("add_entry", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, entry_sizes[s], "evict", iterations, now_ns() - t0);
+    }
+}
+
+static void bench_find(struct aesd_circular_buffer *buffer, uint8_t fill, size_t entry_size, unsigned long iterations)
+{
+    size_t total = fill * entry_size;
+    enum pattern p;
+    for(p=PATTERN_HEAD; p<=PATTERN_RANDOM; p++)
+    {
+        size_t offset, pos = 0;
+        unsigned long i;
+        double t0 = now_ns();
+        for(i=0; i<iterations; i++)
+        {
+            switch(p)
+            {
+                case PATTERN_HEAD: pos = 0; break;
+                case PATTERN_TAIL: pos = total - 1; break;
+                case PATTERN_SEQUENTIAL: pos = pos + 1 < total ? pos + 1 : 0; break;
+                case PATTERN_RANDOM: pos = random_values[i % NRANDOM] % total; break;
+            }
+            sink += (unsigned long long)(uintptr_t)aesd_circular_buffer_find_entry_offset_for_fpos(buffer, pos, &offset);
+        }
+        report("find_entry_offset_for_fpos", fill, entry_size, pattern_names[p], iterations, now_ns() - t0);
+    }
+}
+
+static void bench_get_entry_no(struct aesd_circular_buffer *buffer, uint8_t fill, size_t entry_size, unsigned long iterations)
+{
+    enum pattern p;
+    for(p=PATTERN_HEAD; p<=PATTERN_RANDOM; p++)
+    {
+        unsigned long long entry_offset;
+        unsigned long i;
+        int index = 0;
+        double t0 = now_ns();
+        for(i=0; i<iterations; i++)
+        {
+            switch(p)
+            {
+                case PATTERN_HEAD: index = 0; break;
+                case PATTERN_TAIL: index = fill - 1; break;
+                case PATTERN_SEQUENTIAL: index = index + 1 < fill ? index + 1 : 0; break;
+                case PATTERN_RANDOM: index = random_values[i % NRANDOM] % fill; break;
+            }
+            sink += (unsigned long long)(uintptr_t)aesd_circular_buffer_get_entry_no(buffer, index, &entry_offset);
+        }
+        report("get_entry_no", fill, entry_size, pattern_names[p], iterations, now_ns() - t0);
+    }
+}
+
+static void bench_len(struct aesd_circular_buffer *buffer, uint8_t fill, size_t entry_size, unsigned long iterations)
+{
+    unsigned long i;
+    double t0 = now_ns();
+    for(i=0; i<iterations; i++)
+        sink += aesd_circular_buffer_len(buffer);
+    report("len", fill, entry_size, "-", iterations, now_ns() - t0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+    struct aesd_circular_buffer buffer;
+    unsigned long long x = 88172645463325252ULL;
+    size_t f, s;
+    int i;
+
+    if(!iterations)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+    // xorshift64
+    for(i=0; i<NRANDOM; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        random_values[i] = x;
+    }
+
+    printf("op,entries,entry_size,pattern,iterations,ns_per_op\n");
+    bench_add_entry(iterations);
+    for(f=0; f<sizeof(fills)/sizeof(fills[0]); f++)
+    {
+        for(s=0; s<sizeof(entry_sizes)/sizeof(entry_sizes[0]); s++)
+        {
+            fill_buffer(&buffer, fills[f], entry_sizes[s]);
+            bench_find(&buffer, fills[f], entry_sizes[s], iterations);
+            bench_get_entry_no(&buffer, fills[f], entry_sizes[s], iterations);
+            bench_len(&buffer, fills[f], entry_sizes[s], iterations);
+        }
+    }
+    return 0;
+}
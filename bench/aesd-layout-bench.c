@@ -0,0 +1,310 @@
+/**
+ * @file aesd-layout-bench.c
+ * @brief Reader throughput with the aesdchar device fields laid out as
+ * struct aesd_dev was before and after being split by cache line
+ *
+ * Mimics the driver in user space: a writer appends to its own pending
+ * buffer under the file mutex, every few writes commits an entry under the
+ * sequence lock and now and then closes a file (taking the orphan mutex),
+ * while reader threads look up positions and their record lock-free,
+ * retrying when the sequence changed.
+ *
+ * "old" is the field order aesd_dev had (circular buffer with its indices
+ * after the entries, records, seqlock, orphan fields and mutex packed
+ * together), "split" the current one.  cdev, the stats pointer and the
+ * wait queue are left out.  No gain from the split has been measured: on
+ * one CPU both are within noise of each other.  Run it with readers on
+ * other cores than the writer before drawing conclusions.
+ *
+ * usage: aesd-layout-bench [readers] [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define CACHELINE 64
+#define ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+// commit one entry every this many pending writes
+#define COMMIT_EVERY 16
+// close a file (orphan mutex) every this many commits
+#define CLOSE_EVERY 8
+
+// seqlock_t: the sequence and the spinlock writers take
+struct seqlock
+{
+    atomic_uint seq;
+    pthread_spinlock_t lock;
+};
+
+// the circular buffer with the indices after the entries, as it used to be
+struct old_circular_buffer
+{
+    struct aesd_buffer_entry entry[ENTRIES];
+    uint8_t in_offs;
+    uint8_t out_offs;
+    bool full;
+    unsigned long long base_offs;
+};
+
+// struct aesd_dev before the split
+struct dev_old
+{
+    struct old_circular_buffer circular_buffer;
+    void *records[ENTRIES];
+    struct seqlock lock;
+    struct aesd_buffer_entry orphan_entry;
+    size_t orphan_capacity;
+    pthread_mutex_t orphan_mutex;
+    void *mmap_header;
+};
+
+// struct aesd_dev now
+struct dev_split
+{
+    void *mmap_header;
+    alignas(CACHELINE) struct seqlock lock;
+    struct aesd_circular_buffer circular_buffer;
+    void *records[ENTRIES];
+    alignas(CACHELINE) pthread_mutex_t orphan_mutex;
+    struct aesd_buffer_entry orphan_entry;
+    size_t orphan_capacity;
+};
+
+// struct aesd_file, allocated per open file
+struct file
+{
+    alignas(CACHELINE) pthread_mutex_t write_mutex;
+    size_t pending_size;
+};
+
+struct reader
+{
+    alignas(CACHELINE) void *dev;
+    unsigned long long ops;
+    unsigned long long retries;
+};
+
+struct layout
+{
+    const char *name;
+    void *dev;
+    void (*init)(void *dev);
+    void (*commit)(void *dev, const struct aesd_buffer_entry *entry, void *record);
+    void (*close)(void *dev);
+    // record of position pos (NULL past the end), lock-free
+    void *(*lookup)(void *dev, size_t pos, unsigned long long *retries);
+};
+
+/*
+    The same code for both layouts: the circular buffer functions (only the
+    parts the driver uses) and the driver paths, over either struct
+*/
+#define DEFINE_LAYOUT(type)                                                     \
+static void type##_init(void *arg)                                              \
+{                                                                               \
+    struct type *dev = arg;                                                     \
+    pthread_spin_init(&dev->lock.lock, PTHREAD_PROCESS_PRIVATE);                \
+    pthread_mutex_init(&dev->orphan_mutex, NULL);                               \
+}                                                                               \
+static void type##_commit(void *arg, const struct aesd_buffer_entry *entry, void *record) \
+{                                                                               \
+    struct type *dev = arg;                                                     \
+    unsigned int seq;                                                           \
+    pthread_spin_lock(&dev->lock.lock);                                         \
+    seq = atomic_load_explicit(&dev->lock.seq, memory_order_relaxed);           \
+    atomic_store_explicit(&dev->lock.seq, seq + 1, memory_order_relaxed);       \
+    atomic_thread_fence(memory_order_release);                                  \
+    if(dev->circular_buffer.full)                                               \
+        dev->circular_buffer.base_offs += dev->circular_buffer.entry[dev->circular_buffer.in_offs].size; \
+    dev->circular_buffer.entry[dev->circular_buffer.in_offs] = *entry;          \
+    dev->records[dev->circular_buffer.in_offs] = record;                        \
+    dev->circular_buffer.in_offs = (dev->circular_buffer.in_offs + 1) % ENTRIES; \
+    if(dev->circular_buffer.full)                                               \
+        dev->circular_buffer.out_offs = dev->circular_buffer.in_offs;           \
+    else if(dev->circular_buffer.in_offs == dev->circular_buffer.out_offs)      \
+        dev->circular_buffer.full = true;                                       \
+    atomic_store_explicit(&dev->lock.seq, seq + 2, memory_order_release);       \
+    pthread_spin_unlock(&dev->lock.lock);                                       \
+}                                                                               \
+static void type##_close(void *arg)                                             \
+{                                                                               \
+    struct type *dev = arg;                                                     \
+    pthread_mutex_lock(&dev->orphan_mutex);                                     \
+    dev->orphan_capacity++;                                                     \
+    pthread_mutex_unlock(&dev->orphan_mutex);                                   \
+}                                                                               \
+static void *type##_lookup(void *arg, size_t pos, unsigned long long *retries)  \
+{                                                                               \
+    struct type *dev = arg;                                                     \
+    void *record;                                                               \
+    unsigned int seq;                                                           \
+    do                                                                          \
+    {                                                                           \
+        uint8_t index, i, count;                                                \
+        size_t offset = pos;                                                    \
+        seq = atomic_load_explicit(&dev->lock.seq, memory_order_acquire);       \
+        index = dev->circular_buffer.out_offs;                                  \
+        count = dev->circular_buffer.full ? ENTRIES                             \
+            : (dev->circular_buffer.in_offs + ENTRIES - index) % ENTRIES;       \
+        record = NULL;                                                          \
+        for(i=0; i<count; i++, index = (index + 1) % ENTRIES)                   \
+        {                                                                       \
+            if(offset < dev->circular_buffer.entry[index].size)                 \
+            {                                                                   \
+                record = dev->records[index];                                   \
+                break;                                                          \
+            }                                                                   \
+            offset -= dev->circular_buffer.entry[index].size;                   \
+        }                                                                       \
+        atomic_thread_fence(memory_order_acquire);                              \
+        if(atomic_load_explicit(&dev->lock.seq, memory_order_relaxed) == seq && !(seq & 1)) \
+            break;                                                              \
+        (*retries)++;                                                           \
+    } while(1);                                                                 \
+    return record;                                                              \
+}
+
+DEFINE_LAYOUT(dev_old)
+DEFINE_LAYOUT(dev_split)
+
+static atomic_bool stop;
+static char data[ENTRIES * 32];
+
+static void *writer_thread(void *arg)
+{
+    const struct layout *layout = arg;
+    struct file *file = aligned_alloc(CACHELINE, sizeof(*file));
+    unsigned long i;
+
+    if(!file)
+    {
+        perror("alloc");
+        exit(1);
+    }
+    pthread_mutex_init(&file->write_mutex, NULL);
+    file->pending_size = 0;
+    for(i=0; !atomic_load_explicit(&stop, memory_order_relaxed); i++)
+    {
+        pthread_mutex_lock(&file->write_mutex);
+        file->pending_size++;
+        pthread_mutex_unlock(&file->write_mutex);
+        if(i % COMMIT_EVERY == 0)
+        {
+            struct aesd_buffer_entry entry = {
+                .buffptr = data + (i % ENTRIES) * 32,
+                .size = 32,
+            };
+            layout->commit(layout->dev, &entry, entry.buffptr);
+            if(i % (COMMIT_EVERY * CLOSE_EVERY) == 0)
+                layout->close(layout->dev);
+        }
+    }
+    pthread_mutex_destroy(&file->write_mutex);
+    free(file);
+    return NULL;
+}
+
+struct reader_arg
+{
+    const struct layout *layout;
+    struct reader *reader;
+};
+
+static void *reader_thread(void *arg)
+{
+    const struct layout *layout = ((struct reader_arg *)arg)->layout;
+    struct reader *reader = ((struct reader_arg *)arg)->reader;
+    size_t pos = 0;
+    while(!atomic_load_explicit(&stop, memory_order_relaxed))
+    {
+        pos = layout->lookup(layout->dev, pos, &reader->retries) ? pos + 7 : 0;
+        reader->ops++;
+    }
+    return NULL;
+}
+
+/**
+ * @return reader lookups per second
+ */
+static double run(const struct layout *layout, int nreaders, int seconds)
+{
+    struct reader *readers = aligned_alloc(CACHELINE, sizeof(struct reader) * nreaders);
+    struct reader_arg *args = calloc(nreaders, sizeof(struct reader_arg));
+    pthread_t writer, *threads = calloc(nreaders, sizeof(pthread_t));
+    unsigned long long ops = 0, retries = 0;
+    struct timespec t0, t1;
+    double elapsed;
+    int i;
+    unsigned long k;
+
+    if(!readers || !args || !threads)
+    {
+        perror("alloc");
+        exit(1);
+    }
+    layout->init(layout->dev);
+    // start with a full ring
+    for(k=0; k<ENTRIES; k++)
+    {
+        struct aesd_buffer_entry entry = {.buffptr = data + k * 32, .size = 32};
+        layout->commit(layout->dev, &entry, entry.buffptr);
+    }
+    atomic_store(&stop, false);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i=0; i<nreaders; i++)
+    {
+        readers[i].dev = layout->dev;
+        readers[i].ops = 0;
+        readers[i].retries = 0;
+        args[i].layout = layout;
+        args[i].reader = &readers[i];
+        pthread_create(&threads[i], NULL, reader_thread, &args[i]);
+    }
+    pthread_create(&writer, NULL, writer_thread, (void *)layout);
+    sleep(seconds);
+    atomic_store(&stop, true);
+    pthread_join(writer, NULL);
+    for(i=0; i<nreaders; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ops += readers[i].ops;
+        retries += readers[i].retries;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%s readers=%d lookups=%llu retries=%llu lookups_per_s=%.0f\n",
+        layout->name, nreaders, ops, retries, ops / elapsed);
+    free(threads);
+    free(args);
+    free(readers);
+    return ops / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    int nreaders = argc > 1 ? atoi(argv[1]) : 3;
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+    static struct dev_old old;
+    static struct dev_split split;
+    const struct layout layouts[] = {
+        {"old", &old, dev_old_init, dev_old_commit, dev_old_close, dev_old_lookup},
+        {"split", &split, dev_split_init, dev_split_commit, dev_split_close, dev_split_lookup},
+    };
+    double before, after;
+
+    if(nreaders < 1 || seconds < 1)
+    {
+        fprintf(stderr, "usage: %s [readers] [seconds]\n", argv[0]);
+        return 1;
+    }
+    before = run(&layouts[0], nreaders, seconds);
+    after = run(&layouts[1], nreaders, seconds);
+    printf("ratio=%.2f\n", after / before);
+    return 0;
+}
@@ -1,12 +1,21 @@
+#define _GNU_SOURCE // pipe2
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <poll.h>
+#include <time.h>
 
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 
 #include "systemcalls.h"
 
+extern char **environ;
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -27,6 +36,73 @@ bool do_system(const char *cmd)
     //return true;
 }
 
+/**
+ * Start @param command (execv style: absolute path, no PATH lookup)
+ * @param stdout_fd @param stderr_fd if not negative, become the standard
+ *  output/error of the command
+ * @param pid receives the pid of the command
+ * @return 0, or the error which prevented the command from running
+ *  (e.g. ENOENT if it doesn't exist)
+ */
+static int spawn_command(char *const command[], int stdout_fd, int stderr_fd, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    int err;
+
+    err = posix_spawn_file_actions_init(&actions);
+    if(err)
+        return err;
+    if(stdout_fd >= 0)
+        err = posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+    if(!err && stderr_fd >= 0)
+        err = posix_spawn_file_actions_adddup2(&actions, stderr_fd, STDERR_FILENO);
+    /*
+        posix_spawn doesn't copy our page tables like fork() (it's a
+        vfork-like clone), so it takes the same time whatever our size,
+        and reports exec errors here instead of as an exit status
+    */
+    if(!err)
+        err = posix_spawn(pid, command[0], &actions, NULL, command, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+/**
+ * waitpid, retried on EINTR
+ */
+static bool wait_command(pid_t pid, int *child_status)
+{
+    while(waitpid(pid, child_status, 0) < 0)
+    {
+        if(errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Run @param command and wait for it, see `spawn_command`
+ * @return true if the command exited with status 0
+ *  On false, errno is the error which prevented the command from running,
+ *  or 0 if it ran and failed
+ */
+static bool run_command(char *const command[], int stdout_fd)
+{
+    int child_status, err;
+    pid_t pid;
+
+    err = spawn_command(command, stdout_fd, -1, &pid);
+    if(err)
+    {
+        errno = err;
+        return false;
+    }
+    if(!wait_command(pid, &child_status))
+        return false;
+    errno = 0;
+    return WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -62,35 +138,9 @@ bool do_exec(int count, ...)
  *   as second argument to the execv() command.
  *
 */
-    pid_t pid = fork();
-    int child_status;
-    if(pid < 0)
-    {
-        // failed to fork
-        return false;
-    }
-    if(!pid)
-    {
-        // on child
-        execv(command[0], command);
-        // error
-        exit(1);
-    }
-    else
-    {
-        // on parent
-        pid_t r = waitpid(pid, &child_status, 0);
-        // assert r == pid
-        if(r<0)
-        {
-            // what to do?
-            return false;
-        }
-    }
-
     va_end(args);
 
-    return WEXITSTATUS(child_status) == 0;
+    return run_command(command, -1);
 }
 
 /**
@@ -118,47 +168,317 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *   The rest of the behaviour is same as do_exec()
  *
 */
-    int redirect_fd = open(outputfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    bool ret;
+    va_end(args);
+    // not inherited by anything else we spawn meanwhile, the dup2 in the child clears it
+    int redirect_fd = open(outputfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
     if(redirect_fd < 0)
     {
         // panic
         return false;
     }
-    pid_t pid = fork();
-    int child_status;
-    if(pid < 0)
+    ret = run_command(command, redirect_fd);
+    close(redirect_fd);
+    return ret;
+}
+
+/**
+ * Append @param size bytes read from one stream of the command to @param buf,
+ * growing it as needed, within the capture limit
+ * @return false if out of memory
+ */
+static bool capture_append(struct exec_capture *capture, char **buf, size_t *len, size_t *capacity,
+        const char *data, size_t size)
+{
+    if(capture->limit && *len + size > capture->limit)
     {
-        close(redirect_fd);
-        // failed to fork
-        return false;
+        capture->truncated = true;
+        size = capture->limit - *len;
     }
-    if(!pid)
+    // +1 for the terminating NUL
+    if(*len + size + 1 > *capacity)
     {
-        // on child
-        if(dup2(redirect_fd, STDOUT_FILENO) < 0)
-        {
-            // error
-            exit(1);
-        }
+        size_t new_capacity = *capacity ? *capacity : 4096;
+        char *larger;
+        while(new_capacity < *len + size + 1)
+            new_capacity *= 2;
+        larger = realloc(*buf, new_capacity);
+        if(!larger)
+            return false;
+        *buf = larger;
+        *capacity = new_capacity;
+    }
+    memcpy(*buf + *len, data, size);
+    *len += size;
+    (*buf)[*len] = '\0';
+    return true;
+}
+
+/**
+* @param capture - Where to store the output of the command, see struct exec_capture.
+*   Release the buffers with exec_capture_free, also after a failure.
+* All other parameters, see do_exec above
+* @return see do_exec. Standard output and error are read through pipes while
+*   the command runs, nothing goes through the filesystem.
+*/
+bool do_exec_capture(struct exec_capture *capture, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    int out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+    size_t out_capacity = 0, err_capacity = 0;
+    struct pollfd fds[2];
+    char chunk[4096];
+    int child_status, err = 0;
+    bool ok = true;
+    pid_t pid;
 
-        execv(command[0], command);
-        // error
-        exit(1);
+    capture->out = capture->err = NULL;
+    capture->out_size = capture->err_size = 0;
+    capture->truncated = false;
+    capture->status = -1;
+    // close-on-exec: only the dup2'ed copies end up in the command
+    if(pipe2(out_pipe, O_CLOEXEC) || pipe2(err_pipe, O_CLOEXEC))
+    {
+        err = errno;
+        goto _close;
     }
-    else
+    err = spawn_command(command, out_pipe[1], err_pipe[1], &pid);
+    // only the command writes, so we see EOF when it's done
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    out_pipe[1] = err_pipe[1] = -1;
+    if(err)
+        goto _close;
+
+    fds[0].fd = out_pipe[0];
+    fds[1].fd = err_pipe[0];
+    fds[0].events = fds[1].events = POLLIN;
+    while(fds[0].fd >= 0 || fds[1].fd >= 0)
     {
-        // on parent
-        close(redirect_fd);
-        pid_t r = waitpid(pid, &child_status, 0);
-        // assert r == pid
-        if(r<0)
+        if(poll(fds, 2, -1) < 0)
         {
-            // what to do?
-            return false;
+            if(errno == EINTR)
+                continue;
+            err = errno;
+            // stop reading: closing our ends makes the command's writes fail
+            // (EPIPE) instead of blocking on a full pipe, so it can be reaped
+            for(i=0; i<2; i++)
+            {
+                if(fds[i].fd >= 0)
+                    close(fds[i].fd);
+            }
+            out_pipe[0] = err_pipe[0] = -1;
+            break;
         }
+        for(i=0; i<2; i++)
+        {
+            ssize_t n;
+            if(fds[i].fd < 0 || !fds[i].revents)
+                continue;
+            n = read(fds[i].fd, chunk, sizeof(chunk));
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                // EOF (or error), done with this stream
+                fds[i].fd = -1;
+                continue;
+            }
+            if(capture->callback)
+                capture->callback(i ? STDERR_FILENO : STDOUT_FILENO, chunk, n, capture->arg);
+            // keep reading past an allocation failure, the command mustn't block on a full pipe
+            if(i == 0)
+                ok = capture_append(capture, &capture->out, &capture->out_size, &out_capacity, chunk, n) && ok;
+            else
+                ok = capture_append(capture, &capture->err, &capture->err_size, &err_capacity, chunk, n) && ok;
+        }
+    }
+    if(!wait_command(pid, &child_status))
+    {
+        if(!err)
+            err = errno;
     }
+    else
+        capture->status = child_status;
+    if(!ok && !err)
+        err = ENOMEM;
 
-    va_end(args);
+_close:
+    for(i=0; i<2; i++)
+    {
+        if(out_pipe[i] >= 0)
+            close(out_pipe[i]);
+        if(err_pipe[i] >= 0)
+            close(err_pipe[i]);
+    }
+    errno = err;
+    return !err && WIFEXITED(capture->status) && WEXITSTATUS(capture->status) == 0;
+}
+
+void exec_capture_free(struct exec_capture *capture)
+{
+    free(capture->out);
+    free(capture->err);
+    capture->out = capture->err = NULL;
+    capture->out_size = capture->err_size = 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * A file descriptor which becomes readable when @param pid exits, or -1
+ * if the kernel doesn't have pidfd_open (before Linux 5.3)
+ */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+/**
+* @param commands - The commands to run, see struct exec_batch_command.
+*   The results are stored in each element.
+* @param count - Number of elements in @param commands
+* @param max_parallel - Maximum number of commands running at the same time (0 is 1)
+* @return true if every command ran and exited with status 0
+*   Commands are started in order, a new one as soon as a previous one exits,
+*   which is noticed through a pidfd per command (falls back to waiting for
+*   the oldest running command without one, on kernels without pidfd).
+*   Only the children started here are reaped.
+*/
+bool do_exec_batch(struct exec_batch_command *commands, size_t count, unsigned int max_parallel)
+{
+    struct pollfd *fds;
+    struct exec_batch_command **running;
+    pid_t *pids;
+    uint64_t *started;
+    size_t next = 0, done = 0;
+    unsigned int slot;
+    bool ret = true;
+
+    if(!max_parallel)
+        max_parallel = 1;
+    if(max_parallel > count)
+        max_parallel = count;
+    if(!count)
+        return true;
+    fds = calloc(max_parallel, sizeof(*fds));
+    running = calloc(max_parallel, sizeof(*running));
+    pids = calloc(max_parallel, sizeof(*pids));
+    started = calloc(max_parallel, sizeof(*started));
+    if(!fds || !running || !pids || !started)
+    {
+        ret = false;
+        goto _end;
+    }
+    for(slot=0; slot<max_parallel; slot++)
+        fds[slot].fd = -1;
 
-    return WEXITSTATUS(child_status) == 0;
+    while(done < count)
+    {
+        int child_status;
+        unsigned int oldest;
+        bool no_pidfd = false;
+        // fill the free slots
+        for(slot=0; slot<max_parallel && next<count; slot++)
+        {
+            struct exec_batch_command *cmd;
+            uint64_t t0;
+            if(running[slot])
+                continue;
+            cmd = commands + next++;
+            t0 = now_ns();
+            cmd->status = -1;
+            cmd->error = spawn_command(cmd->command, -1, -1, &pids[slot]);
+            if(cmd->error)
+            {
+                cmd->duration_ns = now_ns() - t0;
+                ret = false;
+                done++;
+                // try the next command in this slot
+                slot--;
+                continue;
+            }
+            running[slot] = cmd;
+            started[slot] = t0;
+            fds[slot].fd = open_pidfd(pids[slot]);
+            fds[slot].events = POLLIN;
+        }
+        if(done == count)
+            break;
+
+        // wait for (at least) one to exit, commands without a pidfd: block
+        // on the one started first
+        oldest = max_parallel;
+        for(slot=0; slot<max_parallel; slot++)
+        {
+            if(running[slot] && fds[slot].fd < 0
+                && (oldest == max_parallel || started[slot] < started[oldest]))
+                oldest = slot;
+        }
+        if(oldest < max_parallel)
+        {
+            no_pidfd = true;
+            fds[oldest].revents = POLLIN;
+        }
+        if(!no_pidfd)
+        {
+            while(poll(fds, max_parallel, -1) < 0)
+            {
+                if(errno != EINTR)
+                {
+                    // can't wait on the pidfds, block on each in turn
+                    for(slot=0; slot<max_parallel; slot++)
+                        fds[slot].revents = running[slot] ? POLLIN : 0;
+                    break;
+                }
+            }
+        }
+        for(slot=0; slot<max_parallel; slot++)
+        {
+            struct exec_batch_command *cmd = running[slot];
+            if(!cmd || !fds[slot].revents)
+                continue;
+            if(wait_command(pids[slot], &child_status))
+                cmd->status = child_status;
+            else
+                cmd->error = errno;
+            cmd->duration_ns = now_ns() - started[slot];
+            if(cmd->error || !WIFEXITED(cmd->status) || WEXITSTATUS(cmd->status))
+                ret = false;
+            if(fds[slot].fd >= 0)
+                close(fds[slot].fd);
+            fds[slot].fd = -1;
+            fds[slot].revents = 0;
+            running[slot] = NULL;
+            done++;
+            if(no_pidfd)
+                break;
+        }
+    }
+_end:
+    free(started);
+    free(pids);
+    free(running);
+    free(fds);
+    return ret;
 }
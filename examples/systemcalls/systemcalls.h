@@ -1,9 +1,57 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 bool do_system(const char *command);
 
+/*
+    On failure, errno tells why the command didn't run (e.g. ENOENT),
+    or is 0 if it ran and exited with a non-zero status
+*/
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/*
+    Output of a command run with do_exec_capture
+*/
+struct exec_capture {
+    // maximum number of bytes kept of each stream, 0 for no limit
+    // (the rest is still read, and passed to callback)
+    size_t limit;
+    // optional, called with each chunk of output as it's read, while the command runs
+    // (stream is STDOUT_FILENO or STDERR_FILENO)
+    void (*callback)(int stream, const char *data, size_t size, void *arg);
+    void *arg;
+    // set by do_exec_capture: the output, NUL terminated (NULL if there was none)
+    char *out;
+    size_t out_size;
+    char *err;
+    size_t err_size;
+    // set by do_exec_capture: some output was dropped because of limit
+    bool truncated;
+    // set by do_exec_capture: waitpid status if the command ran, else -1
+    int status;
+};
+
+bool do_exec_capture(struct exec_capture *capture, int count, ...);
+
+void exec_capture_free(struct exec_capture *capture);
+
+/*
+    One command of do_exec_batch
+*/
+struct exec_batch_command {
+    // execv style argument list, NULL terminated, command[0] an absolute path
+    char *const *command;
+    // set by do_exec_batch: 0 if the command ran, else why it didn't (errno value)
+    int error;
+    // set by do_exec_batch: waitpid status if it ran (see WIFEXITED, WEXITSTATUS)
+    int status;
+    // set by do_exec_batch: from start to exit (monotonic clock)
+    uint64_t duration_ns;
+};
+
+bool do_exec_batch(struct exec_batch_command *commands, size_t count, unsigned int max_parallel);
@@ -1,15 +1,116 @@
+#define _GNU_SOURCE // pthread_mutex_clocklock
 #include "threading.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
 //#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000u;
+    ts->tv_nsec = ns % 1000000000u;
+}
+
+/*
+    Sleep until a monotonic deadline, so signals and clock changes
+    don't cut it short or stretch it
+*/
+static bool sleep_ms(int ms)
+{
+    struct timespec deadline;
+    int err;
+    ns_to_timespec(now_ns() + (uint64_t)ms * 1000000u, &deadline);
+    while((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) != 0)
+    {
+        if(err != EINTR)
+        {
+            errno = err;
+            return false;
+        }
+    }
+    return true;
+}
+
+// pthread_mutex_clocklock: glibc 2.30 on (the macro itself is glibc only,
+// so it can't be used in the same #if as defined())
+#if defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 30)
+#define HAVE_PTHREAD_MUTEX_CLOCKLOCK 1
+#endif
+#endif
+
+/*
+    Lock with a deadline on the monotonic clock (in ns, see now_ns)
+*/
+static int lock_until(pthread_mutex_t *mutex, uint64_t deadline_ns)
+{
+    struct timespec deadline;
+#ifdef HAVE_PTHREAD_MUTEX_CLOCKLOCK
+    ns_to_timespec(deadline_ns, &deadline);
+    return pthread_mutex_clocklock(mutex, CLOCK_MONOTONIC, &deadline);
+#else
+    // pthread_mutex_timedlock only knows CLOCK_REALTIME, convert what's left
+    uint64_t now = now_ns();
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    ns_to_timespec((uint64_t)real.tv_sec * 1000000000u + real.tv_nsec
+            + (deadline_ns > now ? deadline_ns - now : 0), &deadline);
+    return pthread_mutex_timedlock(mutex, &deadline);
+#endif
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+    Spin budget of the adaptive lock, shared by every thread: it follows
+    how long spinning took to get a mutex lately (like glibc's
+    PTHREAD_MUTEX_ADAPTIVE_NP, but for any mutex)
+*/
+#define SPIN_MAX 1000
+static atomic_int adaptive_spins = 100;
+
+/*
+    Spin on @param mutex for a while before giving up (and parking)
+    @return true if it was obtained
+*/
+static bool spin_trylock(pthread_mutex_t *mutex)
+{
+    int spins = atomic_load_explicit(&adaptive_spins, memory_order_relaxed);
+    int limit = spins * 2 < SPIN_MAX ? spins * 2 : SPIN_MAX;
+    int i;
+    for(i=0; i<limit; i++)
+    {
+        if(pthread_mutex_trylock(mutex) == 0)
+            break;
+        cpu_relax();
+    }
+    // move 1/8th of the way towards what this attempt took
+    atomic_store_explicit(&adaptive_spins, spins + (i - spins) / 8, memory_order_relaxed);
+    return i < limit;
+}
+
 void* threadfunc(void* thread_param)
 {
 
@@ -21,17 +122,33 @@ void* threadfunc(void* thread_param)
     // default value
     td->thread_complete_success = false;
 
+    td->lock_timed_out = false;
+    td->lock_wait_ns = 0;
+
     /*
-        time is specified in milliseconds,
-        `usleep` uses microseconds
+        time is specified in milliseconds
     */
-    if(usleep(td->wait_to_obtain_ms * 1000))
+    if(!sleep_ms(td->wait_to_obtain_ms))
     {
         perror("failed to sleep");
         return (void*)td;
     }
 
-    if((err = pthread_mutex_lock(td->mutex)) != 0)
+    uint64_t start = now_ns();
+    if(td->lock_adaptive && spin_trylock(td->mutex))
+        err = 0;
+    else if(td->lock_timeout_ms > 0)
+        err = lock_until(td->mutex, start + (uint64_t)td->lock_timeout_ms * 1000000u);
+    else
+        err = pthread_mutex_lock(td->mutex);
+    // contention, as seen by this thread
+    td->lock_wait_ns = now_ns() - start;
+    if(err == ETIMEDOUT)
+    {
+        td->lock_timed_out = true;
+        return (void*)td;
+    }
+    if(err != 0)
     {
         fprintf(stderr, "failed to lock mutex: %s\n", strerror(err));
         return (void*)td;
@@ -40,7 +157,7 @@ void* threadfunc(void* thread_param)
     // assume everything is okay
     td->thread_complete_success = true;
 
-    if(usleep(td->wait_to_relase_ms * 1000))
+    if(!sleep_ms(td->wait_to_relase_ms))
     {
         perror("failed to sleep");
         // just set to false
@@ -59,6 +176,12 @@ void* threadfunc(void* thread_param)
 
 
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    return start_thread_obtaining_mutex_timed(thread, mutex, wait_to_obtain_ms, wait_to_release_ms, 0, false);
+}
+
+bool start_thread_obtaining_mutex_timed(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms,
+        int lock_timeout_ms, bool lock_adaptive)
 {
     /**
      * TODO: allocate memory for thread_data, setup mutex and wait arguments, pass thread_data to created thread
@@ -77,6 +200,10 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
     td->mutex = mutex;
     td->wait_to_obtain_ms = wait_to_obtain_ms;
     td->wait_to_relase_ms = wait_to_release_ms;
+    td->lock_timeout_ms = lock_timeout_ms;
+    td->lock_adaptive = lock_adaptive;
+    td->lock_wait_ns = 0;
+    td->lock_timed_out = false;
     td->thread_complete_success = false;
 
     // start thread
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 /**
@@ -17,6 +18,25 @@ struct thread_data{
     pthread_mutex_t *mutex;
     int wait_to_obtain_ms;
     int wait_to_relase_ms;
+    /**
+     * Give up obtaining the mutex after this many milliseconds
+     * (monotonic clock), 0 to wait as long as it takes
+     */
+    int lock_timeout_ms;
+    /**
+     * Spin for a while before sleeping on the mutex, the time spun adapts
+     * to how long it took to obtain a mutex recently
+     */
+    bool lock_adaptive;
+
+    /**
+     * Set by the thread: time spent obtaining the mutex, in nanoseconds
+     */
+    uint64_t lock_wait_ns;
+    /**
+     * Set by the thread: lock_timeout_ms expired before the mutex was obtained
+     */
+    bool lock_timed_out;
 
     /**
      * Set to true if the thread completed with success, false
@@ -41,3 +61,12 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Same as start_thread_obtaining_mutex, with a deadline of @param lock_timeout_ms milliseconds
+* (0 for none) to obtain the mutex, and spinning before sleeping on it if @param lock_adaptive.
+* The time spent obtaining the mutex is stored in thread_data.lock_wait_ns, and
+* thread_data.lock_timed_out tells if the thread gave up.
+*/
+bool start_thread_obtaining_mutex_timed(pthread_t *thread, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms,
+        int lock_timeout_ms, bool lock_adaptive);
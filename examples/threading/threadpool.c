@@ -0,0 +1,236 @@
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CACHELINE 64
+
+struct thread_pool_cell {
+    /*
+        Queue position this cell is ready for: equal to it when free for
+        the push at that position, one past it once the task is there
+    */
+    atomic_size_t seq;
+    thread_pool_fn fn;
+    void *arg;
+};
+
+struct thread_pool {
+    // bounded multi-producer multi-consumer queue (D. Vyukov's)
+    struct thread_pool_cell *cells;
+    size_t mask;
+    alignas(CACHELINE) atomic_size_t enqueue_pos;
+    alignas(CACHELINE) atomic_size_t dequeue_pos;
+
+    // futex, bumped on every push and on shutdown
+    alignas(CACHELINE) _Atomic uint32_t work_seq;
+    // workers about to sleep on work_seq
+    atomic_uint idle;
+    atomic_bool shutdown;
+
+    // futex, tasks submitted and not finished yet
+    alignas(CACHELINE) _Atomic uint32_t pending;
+    // threads sleeping in thread_pool_wait
+    atomic_uint waiters;
+
+    pthread_t *threads;
+    unsigned int nthreads;
+};
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val)
+{
+    // returns right away if *addr != val, spurious wake ups are fine for callers
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static bool queue_push(struct thread_pool *pool, thread_pool_fn fn, void *arg)
+{
+    struct thread_pool_cell *cell;
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    for(;;)
+    {
+        intptr_t diff;
+        cell = &pool->cells[pos & pool->mask];
+        diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+        if(diff == 0)
+        {
+            // free, claim it
+            if(atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0)
+            // still holds the task from a lap ago: full
+            return false;
+        else
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    }
+    cell->fn = fn;
+    cell->arg = arg;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_pop(struct thread_pool *pool, thread_pool_fn *fn, void **arg)
+{
+    struct thread_pool_cell *cell;
+    size_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    for(;;)
+    {
+        intptr_t diff;
+        cell = &pool->cells[pos & pool->mask];
+        diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&pool->dequeue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0)
+            // empty
+            return false;
+        else
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    }
+    *fn = cell->fn;
+    *arg = cell->arg;
+    // free for the push one lap later
+    atomic_store_explicit(&cell->seq, pos + pool->mask + 1, memory_order_release);
+    return true;
+}
+
+static void task_done(struct thread_pool *pool)
+{
+    if(atomic_fetch_sub(&pool->pending, 1) == 1 && atomic_load(&pool->waiters))
+        futex_wake(&pool->pending, INT_MAX);
+}
+
+static void* worker(void* thread_param)
+{
+    struct thread_pool *pool = (struct thread_pool*)thread_param;
+    thread_pool_fn fn;
+    void *arg;
+    for(;;)
+    {
+        // read before looking at the queue, so a push after this wakes us
+        uint32_t seen = atomic_load(&pool->work_seq);
+        if(queue_pop(pool, &fn, &arg))
+        {
+            fn(arg);
+            task_done(pool);
+            continue;
+        }
+        // only once the queue is drained
+        if(atomic_load(&pool->shutdown))
+            break;
+        atomic_fetch_add(&pool->idle, 1);
+        futex_wait(&pool->work_seq, seen);
+        atomic_fetch_sub(&pool->idle, 1);
+    }
+    return NULL;
+}
+
+struct thread_pool *thread_pool_create(unsigned int nthreads, size_t capacity)
+{
+    struct thread_pool *pool;
+    size_t size = 2, i;
+    int err;
+
+    if(!nthreads || capacity > SIZE_MAX / 2)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    while(size < capacity)
+        size *= 2;
+    if(posix_memalign((void**)&pool, CACHELINE, sizeof(*pool)))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->cells = calloc(size, sizeof(struct thread_pool_cell));
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if(!pool->cells || !pool->threads)
+    {
+        free(pool->cells);
+        free(pool->threads);
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pool->mask = size - 1;
+    for(i=0; i<size; i++)
+        atomic_init(&pool->cells[i].seq, i);
+
+    for(pool->nthreads=0; pool->nthreads<nthreads; pool->nthreads++)
+    {
+        if((err = pthread_create(&pool->threads[pool->nthreads], NULL, worker, pool)) != 0)
+        {
+            fprintf(stderr, "failed to create thread: %s\n", strerror(err));
+            // stop the ones already running
+            thread_pool_destroy(pool);
+            errno = err;
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+bool thread_pool_submit(struct thread_pool *pool, thread_pool_fn fn, void *arg)
+{
+    if(atomic_load(&pool->shutdown))
+    {
+        errno = ECANCELED;
+        return false;
+    }
+    // counted before it can run, so thread_pool_wait can't miss it
+    atomic_fetch_add(&pool->pending, 1);
+    if(!queue_push(pool, fn, arg))
+    {
+        task_done(pool);
+        errno = EAGAIN;
+        return false;
+    }
+    atomic_fetch_add(&pool->work_seq, 1);
+    if(atomic_load(&pool->idle))
+        futex_wake(&pool->work_seq, 1);
+    return true;
+}
+
+void thread_pool_wait(struct thread_pool *pool)
+{
+    uint32_t pending;
+    atomic_fetch_add(&pool->waiters, 1);
+    while((pending = atomic_load(&pool->pending)) != 0)
+        futex_wait(&pool->pending, pending);
+    atomic_fetch_sub(&pool->waiters, 1);
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+    unsigned int i;
+    atomic_store(&pool->shutdown, true);
+    atomic_fetch_add(&pool->work_seq, 1);
+    futex_wake(&pool->work_seq, INT_MAX);
+    for(i=0; i<pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    free(pool->cells);
+    free(pool);
+}
@@ -0,0 +1,41 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A fixed set of worker threads running tasks from a bounded queue.
+ * Submitting a task is a lock-free queue push (no thread creation); idle
+ * workers sleep on a futex and are only woken when there is work.
+ */
+struct thread_pool;
+
+/**
+ * A task run by one of the workers, @param arg is the one given to thread_pool_submit
+ */
+typedef void (*thread_pool_fn)(void *arg);
+
+/**
+* Start @param nthreads workers, with room for @param capacity queued tasks
+* (rounded up to a power of two).
+* @return the pool, or NULL if it couldn't be created (errno is set)
+*/
+struct thread_pool *thread_pool_create(unsigned int nthreads, size_t capacity);
+
+/**
+* Queue @param fn to be run with @param arg by one of the workers.
+* May be called from any thread, tasks included.
+* @return true if queued, false if the queue is full (errno EAGAIN) or the
+* pool is shutting down (errno ECANCELED)
+*/
+bool thread_pool_submit(struct thread_pool *pool, thread_pool_fn fn, void *arg);
+
+/**
+* Block until every task submitted so far (and any they submit) has finished.
+* Must not be called from a task.
+*/
+void thread_pool_wait(struct thread_pool *pool);
+
+/**
+* Run what's left in the queue, stop and join the workers, and free @param pool.
+* Tasks can't be submitted anymore once this is called.
+*/
+void thread_pool_destroy(struct thread_pool *pool);
@@ -0,0 +1,375 @@
+#include "finder-index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+
+/*
+	File layout (host byte order, it's a cache):
+	  header, search string, then per file:
+	  disk_record, path (no NUL), bloom
+*/
+
+#define INDEX_MAGIC "FIDX"
+#define INDEX_VERSION 1
+// filesystem timestamps lag the clock a bit, files modified this close to
+// the previous run are looked at again
+#define INDEX_RACY_NS 1000000000LL
+
+struct disk_header {
+	char magic[4];
+	uint32_t version;
+	int64_t started_ns;
+	uint32_t bloom_bytes;
+	uint32_t search_len;
+	uint64_t count;
+};
+
+struct disk_record {
+	int64_t mtime_ns;
+	uint64_t size;
+	uint64_t lines;
+	uint64_t matches;
+	uint32_t flags;
+	uint32_t path_len;
+};
+
+struct loaded_entry {
+	const char *path;
+	uint32_t path_len;
+	struct index_entry entry;
+};
+
+struct finder_index {
+	char *data;
+	int64_t started_ns;
+	const char *search;
+	size_t search_len;
+	struct loaded_entry *entries;
+	size_t count;
+	// open addressing, entry number + 1 (0: free)
+	size_t *table;
+	size_t mask;
+};
+
+static uint32_t hash_path(const char *path, size_t len)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	while(len--)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h;
+}
+
+static unsigned int bloom_bit(uint32_t trigram)
+{
+	// multiplicative hash, top 12 bits for 4096
+	return (trigram * 2654435761u) >> (32 - 12);
+}
+
+static bool read_all(int fd, char *buf, size_t len)
+{
+	while(len)
+	{
+		ssize_t n = read(fd, buf, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+struct finder_index *index_load(const char *file)
+{
+	struct finder_index *index;
+	struct disk_header header;
+	struct stat st;
+	size_t pos, i, table_size = 2;
+	int fd = open(file, O_RDONLY|O_CLOEXEC);
+
+	if(fd < 0)
+		return NULL;
+	index = calloc(1, sizeof(*index));
+	if(!index || fstat(fd, &st) || (size_t)st.st_size < sizeof(header))
+		goto _fail;
+	index->data = malloc(st.st_size);
+	if(!index->data || !read_all(fd, index->data, st.st_size))
+		goto _fail;
+	close(fd);
+	fd = -1;
+
+	memcpy(&header, index->data, sizeof(header));
+	pos = sizeof(header);
+	if(memcmp(header.magic, INDEX_MAGIC, 4) || header.version != INDEX_VERSION
+			|| header.bloom_bytes != INDEX_BLOOM_BYTES || header.search_len > st.st_size - pos)
+		goto _fail;
+	index->started_ns = header.started_ns;
+	index->search = index->data + pos;
+	index->search_len = header.search_len;
+	pos += header.search_len;
+	// at least a record each
+	if(header.count > (st.st_size - pos) / (sizeof(struct disk_record) + INDEX_BLOOM_BYTES))
+		goto _fail;
+	index->entries = calloc(header.count ? header.count : 1, sizeof(struct loaded_entry));
+	while(table_size < header.count * 2)
+		table_size *= 2;
+	index->table = calloc(table_size, sizeof(size_t));
+	if(!index->entries || !index->table)
+		goto _fail;
+	index->mask = table_size - 1;
+
+	for(i=0; i<header.count; i++)
+	{
+		struct loaded_entry *e = &index->entries[i];
+		struct disk_record record;
+		size_t slot;
+		if(st.st_size - pos < sizeof(record))
+			goto _fail;
+		memcpy(&record, index->data + pos, sizeof(record));
+		pos += sizeof(record);
+		if(st.st_size - pos < (size_t)record.path_len + INDEX_BLOOM_BYTES)
+			goto _fail;
+		e->path = index->data + pos;
+		e->path_len = record.path_len;
+		pos += record.path_len;
+		e->entry.mtime_ns = record.mtime_ns;
+		e->entry.size = record.size;
+		e->entry.lines = record.lines;
+		e->entry.matches = record.matches;
+		e->entry.flags = record.flags;
+		memcpy(e->entry.bloom, index->data + pos, INDEX_BLOOM_BYTES);
+		pos += INDEX_BLOOM_BYTES;
+
+		for(slot = hash_path(e->path, e->path_len) & index->mask; index->table[slot]; slot = (slot + 1) & index->mask)
+			;
+		index->table[slot] = i + 1;
+	}
+	index->count = header.count;
+	return index;
+
+_fail:
+	if(fd >= 0)
+		close(fd);
+	index_free(index);
+	return NULL;
+}
+
+const struct index_entry *index_lookup(const struct finder_index *index, const char *path,
+		int64_t mtime_ns, uint64_t size)
+{
+	size_t len = strlen(path), slot;
+	if(!index)
+		return NULL;
+	for(slot = hash_path(path, len) & index->mask; index->table[slot]; slot = (slot + 1) & index->mask)
+	{
+		const struct loaded_entry *e = &index->entries[index->table[slot] - 1];
+		if(e->path_len != len || memcmp(e->path, path, len))
+			continue;
+		if(e->entry.mtime_ns != mtime_ns || e->entry.size != size)
+			return NULL;
+		// may have changed again right after being indexed, same mtime
+		if(mtime_ns + INDEX_RACY_NS >= index->started_ns)
+			return NULL;
+		return &e->entry;
+	}
+	return NULL;
+}
+
+size_t index_size(const struct finder_index *index)
+{
+	return index ? index->count : 0;
+}
+
+bool index_same_search(const struct finder_index *index, const char *searchstr)
+{
+	return index && strlen(searchstr) == index->search_len
+		&& !memcmp(searchstr, index->search, index->search_len);
+}
+
+bool index_may_contain(const struct index_entry *entry, const char *s, size_t len)
+{
+	uint32_t trigram = 0;
+	size_t i;
+	if(entry->flags & INDEX_BLOOM_FULL)
+		return true;
+	if(len > entry->size)
+		return false;
+	for(i=0; i<len; i++)
+	{
+		unsigned int bit;
+		trigram = (trigram << 8 | (unsigned char)s[i]) & 0xffffff;
+		if(i < 2)
+			continue;
+		bit = bloom_bit(trigram);
+		if(!(entry->bloom[bit / 8] & 1 << bit % 8))
+			return false;
+	}
+	return true;
+}
+
+void index_builder_init(struct index_builder *builder, struct index_entry *entry)
+{
+	builder->entry = entry;
+	builder->trigram = 0;
+	builder->bytes = 0;
+	builder->last = '\n';
+	entry->lines = 0;
+	entry->flags = 0;
+	memset(entry->bloom, 0, INDEX_BLOOM_BYTES);
+}
+
+void index_builder_feed(struct index_builder *builder, const char *buf, size_t len)
+{
+	struct index_entry *entry = builder->entry;
+	uint32_t trigram = builder->trigram;
+	uint64_t lines = 0;
+	size_t i = 0;
+	if(!len)
+		return;
+	// the first two bytes of the file don't end a trigram
+	for(; i<len && builder->bytes + i < 2; i++)
+	{
+		trigram = (trigram << 8 | (unsigned char)buf[i]) & 0xffffff;
+		lines += buf[i] == '\n';
+	}
+	for(; i<len; i++)
+	{
+		unsigned int bit;
+		trigram = (trigram << 8 | (unsigned char)buf[i]) & 0xffffff;
+		bit = bloom_bit(trigram);
+		entry->bloom[bit / 8] |= 1 << bit % 8;
+		lines += buf[i] == '\n';
+	}
+	entry->lines += lines;
+	builder->trigram = trigram;
+	builder->bytes += len;
+	builder->last = buf[len - 1];
+}
+
+void index_builder_finish(struct index_builder *builder)
+{
+	struct index_entry *entry = builder->entry;
+	unsigned int set = 0, i;
+	// the last line, without a newline
+	if(builder->last != '\n')
+		entry->lines++;
+	for(i=0; i<INDEX_BLOOM_BYTES; i++)
+		set += __builtin_popcount(entry->bloom[i]);
+	if(set > INDEX_BLOOM_BYTES * 8 / 2)
+		entry->flags |= INDEX_BLOOM_FULL;
+}
+
+bool index_list_add(struct index_list *list, const char *path, const struct index_entry *entry)
+{
+	struct index_item *item;
+	if(list->count == list->capacity)
+	{
+		size_t capacity = list->capacity ? list->capacity * 2 : 64;
+		struct index_item *items = realloc(list->items, capacity * sizeof(struct index_item));
+		if(!items)
+			return false;
+		list->items = items;
+		list->capacity = capacity;
+	}
+	item = &list->items[list->count];
+	item->path = strdup(path);
+	if(!item->path)
+		return false;
+	item->entry = *entry;
+	list->count++;
+	return true;
+}
+
+void index_list_free(struct index_list *list)
+{
+	size_t i;
+	for(i=0; i<list->count; i++)
+		free(list->items[i].path);
+	free(list->items);
+	list->items = NULL;
+	list->count = list->capacity = 0;
+}
+
+bool index_save(const char *file, const char *searchstr, int64_t started_ns,
+		const struct index_list *lists, unsigned int n_lists)
+{
+	struct disk_header header;
+	char *tmp = malloc(strlen(file) + 32);
+	FILE *f = NULL;
+	unsigned int l;
+	size_t i;
+	int err;
+
+	if(!tmp)
+		return false;
+	// written aside and renamed, a concurrent run sees the old or the new one
+	sprintf(tmp, "%s.%ld.tmp", file, (long)getpid());
+	f = fopen(tmp, "we");
+	if(!f)
+		goto _fail;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, 4);
+	header.version = INDEX_VERSION;
+	header.started_ns = started_ns;
+	header.bloom_bytes = INDEX_BLOOM_BYTES;
+	header.search_len = strlen(searchstr);
+	for(l=0; l<n_lists; l++)
+		header.count += lists[l].count;
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(searchstr, 1, header.search_len, f);
+	for(l=0; l<n_lists; l++)
+	{
+		for(i=0; i<lists[l].count; i++)
+		{
+			const struct index_item *item = &lists[l].items[i];
+			struct disk_record record;
+			memset(&record, 0, sizeof(record));
+			record.mtime_ns = item->entry.mtime_ns;
+			record.size = item->entry.size;
+			record.lines = item->entry.lines;
+			record.matches = item->entry.matches;
+			record.flags = item->entry.flags;
+			record.path_len = strlen(item->path);
+			fwrite(&record, sizeof(record), 1, f);
+			fwrite(item->path, 1, record.path_len, f);
+			fwrite(item->entry.bloom, 1, INDEX_BLOOM_BYTES, f);
+		}
+	}
+	if(ferror(f) | fclose(f))
+	{
+		f = NULL;
+		goto _fail;
+	}
+	f = NULL;
+	if(rename(tmp, file))
+		goto _fail;
+	free(tmp);
+	return true;
+
+_fail:
+	err = errno;
+	if(f)
+		fclose(f);
+	unlink(tmp);
+	free(tmp);
+	errno = err;
+	return false;
+}
+
+void index_free(struct finder_index *index)
+{
+	if(!index)
+		return;
+	free(index->table);
+	free(index->entries);
+	free(index->data);
+	free(index);
+}
@@ -0,0 +1,109 @@
+#ifndef FINDER_INDEX_H
+#define FINDER_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * On-disk index for repeated finder runs over the same tree: per file,
+ * keyed by (path, mtime, size), the number of lines, the number of lines
+ * matching the search string of the run that wrote it, and a bloom filter
+ * of the trigrams in the file. Unchanged files are then answered from the
+ * index, or skipped when their filter says they can't hold the string.
+ */
+
+// 4096 bits, one per trigram hash
+#define INDEX_BLOOM_BYTES 512
+
+// too many bits set to rule anything out
+#define INDEX_BLOOM_FULL 0x1
+
+struct index_entry {
+	int64_t mtime_ns;
+	uint64_t size;
+	// lines grep reads in the file (all of them, for an empty pattern)
+	uint64_t lines;
+	// lines matching the search string
+	uint64_t matches;
+	uint32_t flags;
+	uint8_t bloom[INDEX_BLOOM_BYTES];
+};
+
+/**
+ * Computes the lines and bloom of an entry from the bytes fed in order
+ */
+struct index_builder {
+	struct index_entry *entry;
+	uint32_t trigram;
+	uint64_t bytes;
+	char last;
+};
+
+struct index_item {
+	char *path;
+	struct index_entry entry;
+};
+
+/**
+ * Entries of a run, one list per thread
+ */
+struct index_list {
+	struct index_item *items;
+	size_t count, capacity;
+};
+
+struct finder_index;
+
+/**
+ * Load the index at @param file, written by a previous run.
+ * @return the index, or NULL if there is none or it can't be used (an
+ * empty index then)
+ */
+struct finder_index *index_load(const char *file);
+
+/**
+ * @return the entry for @param path if the file hasn't changed since it
+ * was indexed, NULL otherwise. @param index may be NULL.
+ */
+const struct index_entry *index_lookup(const struct finder_index *index, const char *path,
+		int64_t mtime_ns, uint64_t size);
+
+/**
+ * @return the number of files in @param index (0 if NULL)
+ */
+size_t index_size(const struct finder_index *index);
+
+/**
+ * @return true if the matches in @param index were counted for @param searchstr
+ */
+bool index_same_search(const struct finder_index *index, const char *searchstr);
+
+/**
+ * @return false if @param entry can't hold the @param len bytes at @param s
+ */
+bool index_may_contain(const struct index_entry *entry, const char *s, size_t len);
+
+void index_builder_init(struct index_builder *builder, struct index_entry *entry);
+void index_builder_feed(struct index_builder *builder, const char *buf, size_t len);
+void index_builder_finish(struct index_builder *builder);
+
+/**
+ * Add a copy of @param path with @param entry to @param list
+ * @return false if out of memory
+ */
+bool index_list_add(struct index_list *list, const char *path, const struct index_entry *entry);
+
+void index_list_free(struct index_list *list);
+
+/**
+ * Replace @param file with the entries of @param lists, matches counted
+ * for @param searchstr, by a run started at @param started_ns (realtime)
+ * @return false on error, errno set
+ */
+bool index_save(const char *file, const char *searchstr, int64_t started_ns,
+		const struct index_list *lists, unsigned int n_lists);
+
+void index_free(struct finder_index *index);
+
+#endif
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE // memmem, REG_STARTEND
+#include "finder-match.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MATCH_X86
+#include <immintrin.h>
+#endif
+
+/*
+	Kernels: find a byte (newlines, NUL) and find a string. The SIMD ones
+	are built with target attributes, so the rest of the program doesn't
+	need -mavx2, and only called once CPUID says they can run.
+
+	The string search compares the first and the last byte of the string
+	at every position of a block at once, only the candidates matching
+	both get a memcmp (W. Mula's "SIMD-friendly algorithm for substring
+	searching").
+*/
+
+struct match_kernels {
+	const char *name;
+	const char *(*find_byte)(const char *buf, size_t len, int c);
+	const char *(*find_string)(const char *buf, size_t len, const char *s, size_t s_len);
+};
+
+static const char *find_byte_scalar(const char *buf, size_t len, int c)
+{
+	return memchr(buf, c, len);
+}
+
+static const char *find_string_scalar(const char *buf, size_t len, const char *s, size_t s_len)
+{
+	return memmem(buf, len, s, s_len);
+}
+
+#ifdef MATCH_X86
+__attribute__((target("sse2")))
+static const char *find_byte_sse2(const char *buf, size_t len, int c)
+{
+	const __m128i v = _mm_set1_epi8((char)c);
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), v);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 16)), v);
+		uint32_t mask;
+		// one test for both halves, most blocks have nothing
+		if(!_mm_movemask_epi8(_mm_or_si128(a, b)))
+			continue;
+		mask = (uint32_t)_mm_movemask_epi8(a) | (uint32_t)_mm_movemask_epi8(b) << 16;
+		return buf + i + __builtin_ctz(mask);
+	}
+	return find_byte_scalar(buf + i, len - i, c);
+}
+
+__attribute__((target("sse2")))
+static const char *find_string_sse2(const char *buf, size_t len, const char *s, size_t s_len)
+{
+	__m128i first, last;
+	size_t i = 0;
+	if(s_len < 2)
+		return s_len ? find_byte_sse2(buf, len, s[0]) : buf;
+	first = _mm_set1_epi8(s[0]);
+	last = _mm_set1_epi8(s[s_len - 1]);
+	for(; i + s_len - 1 + 16 <= len; i += 16)
+	{
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), first);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + s_len - 1)), last);
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+		for(; mask; mask &= mask - 1)
+		{
+			size_t pos = i + __builtin_ctz(mask);
+			if(!memcmp(buf + pos + 1, s + 1, s_len - 2))
+				return buf + pos;
+		}
+	}
+	return find_string_scalar(buf + i, len - i, s, s_len);
+}
+
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *buf, size_t len, int c)
+{
+	const __m256i v = _mm256_set1_epi8((char)c);
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64)
+	{
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), v);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 32)), v);
+		uint64_t mask;
+		if(_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+			continue;
+		mask = (uint32_t)_mm256_movemask_epi8(a) | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+		return buf + i + __builtin_ctzll(mask);
+	}
+	return find_byte_sse2(buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static const char *find_string_avx2(const char *buf, size_t len, const char *s, size_t s_len)
+{
+	__m256i first, last;
+	size_t i = 0;
+	if(s_len < 2)
+		return s_len ? find_byte_avx2(buf, len, s[0]) : buf;
+	first = _mm256_set1_epi8(s[0]);
+	last = _mm256_set1_epi8(s[s_len - 1]);
+	for(; i + s_len - 1 + 32 <= len; i += 32)
+	{
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), first);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + s_len - 1)), last);
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+		for(; mask; mask &= mask - 1)
+		{
+			size_t pos = i + __builtin_ctz(mask);
+			if(!memcmp(buf + pos + 1, s + 1, s_len - 2))
+				return buf + pos;
+		}
+	}
+	return find_string_sse2(buf + i, len - i, s, s_len);
+}
+#endif
+
+static const struct match_kernels scalar_kernels = {"scalar", find_byte_scalar, find_string_scalar};
+#ifdef MATCH_X86
+static const struct match_kernels sse2_kernels = {"sse2", find_byte_sse2, find_string_sse2};
+static const struct match_kernels avx2_kernels = {"avx2", find_byte_avx2, find_string_avx2};
+#endif
+
+static const struct match_kernels *kernels = &scalar_kernels;
+
+void match_init(void)
+{
+	const char *force = getenv("FINDER_MATCH");
+	kernels = &scalar_kernels;
+#ifdef MATCH_X86
+	__builtin_cpu_init();
+	// CPUID, AVX2 also needs the OS to save the ymm registers (checked too)
+	if(__builtin_cpu_supports("sse2") && !(force && !strcmp(force, "scalar")))
+		kernels = &sse2_kernels;
+	if(__builtin_cpu_supports("avx2") && !(force && strcmp(force, "avx2")))
+		kernels = &avx2_kernels;
+#else
+	(void)force;
+#endif
+}
+
+const char *match_kernel_name(void)
+{
+	return kernels->name;
+}
+
+bool match_compile(struct match_pattern *pattern, const char *searchstr)
+{
+	pattern->literal = searchstr;
+	pattern->literal_len = strlen(searchstr);
+	pattern->is_regex = strpbrk(searchstr, ".[]*^$\\") != NULL;
+	if(pattern->is_regex && regcomp(&pattern->regex, searchstr, REG_NOSUB))
+	{
+		pattern->is_regex = false;
+		return false;
+	}
+	return true;
+}
+
+const char *match_find_byte(const char *buf, size_t len, int c)
+{
+	return kernels->find_byte(buf, len, c);
+}
+
+size_t match_count_lines(const struct match_pattern *pattern, const char *buf, size_t len, bool eof, long *lines)
+{
+	const char *p = buf, *end = buf + len;
+	if(!pattern->is_regex)
+	{
+		// jump from match to match instead of looking at every line
+		const char *match;
+		while(p < end && (match = kernels->find_string(p, end - p, pattern->literal, pattern->literal_len)) != NULL)
+		{
+			const char *line_end = kernels->find_byte(match, end - match, '\n');
+			if(!line_end && !eof)
+				// the line isn't complete yet
+				break;
+			(*lines)++;
+			if(!line_end)
+				return len;
+			p = line_end + 1;
+		}
+		if(eof)
+			return len;
+		// keep the incomplete last line
+		while(end > p && end[-1] != '\n')
+			end--;
+		return end - buf;
+	}
+	while(p < end)
+	{
+		regmatch_t match;
+		const char *line_end = kernels->find_byte(p, end - p, '\n');
+		if(!line_end)
+		{
+			if(!eof)
+				break;
+			line_end = end;
+		}
+		match.rm_so = 0;
+		match.rm_eo = line_end - p;
+		if(!regexec(&pattern->regex, p, 1, &match, REG_STARTEND))
+			(*lines)++;
+		p = line_end < end ? line_end + 1 : end;
+	}
+	return p - buf;
+}
@@ -0,0 +1,52 @@
+#ifndef FINDER_MATCH_H
+#define FINDER_MATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <regex.h>
+
+/**
+ * Line matching for finder: counts the lines holding a search string, the
+ * way grep does. Plain strings go through byte and substring search
+ * kernels (SSE2/AVX2 on x86, picked at runtime from CPUID, plain C
+ * otherwise), anything else through regexec.
+ */
+struct match_pattern {
+	const char *literal;
+	size_t literal_len;
+	// when not a plain string
+	bool is_regex;
+	regex_t regex;
+};
+
+/**
+ * Pick the fastest kernels this CPU has, FINDER_MATCH=scalar|sse2|avx2
+ * forces one (if supported). Must be called before anything else here.
+ */
+void match_init(void);
+
+/**
+ * @return the name of the kernels in use
+ */
+const char *match_kernel_name(void);
+
+/**
+ * Set @param pattern up for @param searchstr, a basic regular expression
+ * as grep takes it.
+ * @return false if it isn't a valid expression
+ */
+bool match_compile(struct match_pattern *pattern, const char *searchstr);
+
+/**
+ * @return the first @param c in the @param len bytes at @param buf, or NULL
+ */
+const char *match_find_byte(const char *buf, size_t len, int c);
+
+/**
+ * Count the lines of @param buf holding @param pattern into @param lines.
+ * Unless @param eof, the last line is only looked at once it's complete.
+ * @return the number of bytes consumed (the complete lines)
+ */
+size_t match_count_lines(const struct match_pattern *pattern, const char *buf, size_t len, bool eof, long *lines);
+
+#endif
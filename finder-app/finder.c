@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "finder-match.h"
+#include "finder-index.h"
+
+/*
+	Native finder.sh: same arguments, output and exit status, but one
+	directory walk instead of `grep -r` plus `find`, spread over a thread
+	per core (FINDER_THREADS overrides it).
+
+	usage: finder <filesdir> <searchstr>
+
+	Mirrors what the script's pipelines count:
+	  - files: regular files, symlinks not followed (find -type f), none if
+	    filesdir itself is a symlink
+	  - lines: lines containing searchstr (a basic regular expression, as
+	    grep takes it) in regular files, symlinks found while walking not
+	    followed (grep -r)
+	  - a file with a NUL byte is binary to grep: its matches are reported
+	    on stderr, so they count from the start of the buffer holding the
+	    first NUL on (buffers of GREP_BUFSIZE)
+	  - a path holding newlines counts as that many more lines, in both
+	The script's word splitting of an unquoted searchstr holding spaces
+	(the extra words become grep operands) isn't reproduced.
+
+	FINDER_INDEX=<file> keeps an index of the files (see finder-index.h)
+	so the next runs only read the files that changed, or may hold
+	searchstr. Keep it out of filesdir, or it gets counted.
+*/
+
+#define GREP_BUFSIZE (96 * 1024)
+// smaller files are read, mapping them costs more than the copy
+#define MMAP_MIN (256 * 1024)
+
+struct item {
+	char *path;
+	bool is_dir;
+};
+
+/*
+	Work-stealing deque: the owner pushes and pops at the bottom (depth
+	first, keeps its paths hot), thieves take from the top (the oldest,
+	usually biggest, directories)
+*/
+struct deque {
+	pthread_mutex_t lock;
+	struct item *items;
+	size_t top, bottom, capacity;
+};
+
+struct worker {
+	pthread_t thread;
+	struct deque deque;
+	unsigned int index;
+	long files;
+	long lines;
+	// out of memory, results incomplete
+	bool failed;
+	// files looked at, for the next index
+	struct index_list index_list;
+	// files read for it
+	long indexed;
+};
+
+static struct match_pattern pattern;
+// false if searchstr isn't a valid expression (grep fails)
+static bool pattern_ok;
+static const char *searchstr;
+// FINDER_INDEX, NULL without one
+static const char *index_file;
+// the index written by the previous run, if any
+static struct finder_index *prev_index;
+static struct worker *workers;
+static unsigned int n_workers;
+// items pushed and not processed yet
+static atomic_long outstanding;
+// futex, bumped on every push and when outstanding drops to 0
+static _Atomic uint32_t work_seq;
+// workers about to sleep on work_seq
+static atomic_uint idle;
+static bool count_files = true;
+
+static size_t count_newlines(const char *s)
+{
+	size_t n = 0;
+	for(; *s; s++)
+		if(*s == '\n')
+			n++;
+	return n;
+}
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val)
+{
+	// returns right away if *addr != val, spurious wake ups are fine for callers
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static bool deque_push(struct deque *d, struct item item)
+{
+	bool ok = true;
+	pthread_mutex_lock(&d->lock);
+	if(d->top == d->bottom)
+		d->top = d->bottom = 0;
+	if(d->bottom == d->capacity)
+	{
+		// compact or grow
+		if(d->top > 0)
+		{
+			memmove(d->items, d->items + d->top, (d->bottom - d->top) * sizeof(struct item));
+			d->bottom -= d->top;
+			d->top = 0;
+		}
+		else
+		{
+			size_t capacity = d->capacity ? d->capacity * 2 : 64;
+			struct item *items = realloc(d->items, capacity * sizeof(struct item));
+			if(items)
+			{
+				d->items = items;
+				d->capacity = capacity;
+			}
+			else
+				ok = false;
+		}
+	}
+	if(ok)
+		d->items[d->bottom++] = item;
+	pthread_mutex_unlock(&d->lock);
+	return ok;
+}
+
+static bool deque_pop(struct deque *d, struct item *item, bool steal)
+{
+	bool ok = false;
+	pthread_mutex_lock(&d->lock);
+	if(d->top < d->bottom)
+	{
+		*item = steal ? d->items[d->top++] : d->items[--d->bottom];
+		ok = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return ok;
+}
+
+/*
+	An item was processed (or dropped), the last one ends the walk: wake
+	every idle worker up to see it
+*/
+static void item_done(void)
+{
+	if(atomic_fetch_sub(&outstanding, 1) == 1)
+	{
+		atomic_fetch_add(&work_seq, 1);
+		futex_wake(&work_seq, INT_MAX);
+	}
+}
+
+static void push_item(struct worker *w, char *path, bool is_dir)
+{
+	struct item item = {path, is_dir};
+	atomic_fetch_add(&outstanding, 1);
+	if(!deque_push(&w->deque, item))
+	{
+		free(path);
+		w->failed = true;
+		item_done();
+		return;
+	}
+	// one idle worker can steal it
+	atomic_fetch_add(&work_seq, 1);
+	if(atomic_load(&idle))
+		futex_wake(&work_seq, 1);
+}
+
+/*
+	Count a whole file mapped at @param data, in GREP_BUFSIZE windows like
+	the reads below, so a NUL stops it at the same place
+*/
+static long grep_mapped(const char *data, size_t size, struct index_builder *builder)
+{
+	size_t consumed;
+	size_t start = 0, scanned = 0;
+	long lines = 0;
+	while(scanned < size)
+	{
+		size_t window = size - scanned > GREP_BUFSIZE ? GREP_BUFSIZE : size - scanned;
+		if(match_find_byte(data + scanned, window, '\0'))
+			// binary from here on
+			break;
+		scanned += window;
+		consumed = match_count_lines(&pattern, data + start, scanned - start, scanned == size, &lines);
+		if(builder)
+			index_builder_feed(builder, data + start, consumed);
+		start += consumed;
+	}
+	return lines;
+}
+
+static long grep_read(struct worker *w, int fd, struct index_builder *builder)
+{
+	char *buf;
+	size_t used = 0, capacity = GREP_BUFSIZE;
+	long lines = 0;
+	ssize_t n;
+
+	buf = malloc(capacity);
+	if(!buf)
+	{
+		w->failed = true;
+		return 0;
+	}
+	for(;;)
+	{
+		size_t consumed;
+		if(used == capacity)
+		{
+			// a line longer than the buffer
+			char *larger = realloc(buf, capacity * 2);
+			if(!larger)
+			{
+				w->failed = true;
+				break;
+			}
+			buf = larger;
+			capacity *= 2;
+		}
+		n = read(fd, buf + used, capacity - used > GREP_BUFSIZE ? GREP_BUFSIZE : capacity - used);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			break;
+		if(n > 0 && match_find_byte(buf + used, n, '\0'))
+			// binary from here on
+			break;
+		used += n;
+		consumed = match_count_lines(&pattern, buf, used, n == 0, &lines);
+		if(builder)
+			index_builder_feed(builder, buf, consumed);
+		if(n == 0)
+			break;
+		memmove(buf, buf + consumed, used - consumed);
+		used -= consumed;
+	}
+	free(buf);
+	return lines;
+}
+
+/*
+	@return the number of lines grep -r would print for the file at @param path
+	(-1 if it can't be read), reading it through @param builder if not NULL
+*/
+static long scan_file(struct worker *w, const char *path, struct index_builder *builder)
+{
+	struct stat st;
+	long lines = -1;
+	int fd = open(path, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+
+	if(fd < 0)
+		// grep complains on stderr, nothing on stdout
+		return -1;
+	if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size >= MMAP_MIN)
+	{
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data != MAP_FAILED)
+		{
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			lines = grep_mapped(data, st.st_size, builder);
+			munmap(data, st.st_size);
+		}
+	}
+	if(lines < 0)
+		lines = grep_read(w, fd, builder);
+	close(fd);
+	return lines;
+}
+
+/*
+	@return the number of lines grep -r would print for the file at @param path,
+	from the index when it's unchanged
+*/
+static long grep_file(struct worker *w, const char *path)
+{
+	struct stat st;
+	struct index_entry entry;
+	struct index_builder builder;
+	const struct index_entry *indexed;
+	long lines = -1;
+
+	if(!pattern_ok)
+		// invalid expression, grep failed
+		return 0;
+	if(!index_file || lstat(path, &st))
+	{
+		lines = scan_file(w, path, NULL);
+		return lines < 0 ? 0 : lines;
+	}
+
+	indexed = index_lookup(prev_index, path, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, st.st_size);
+	if(indexed)
+	{
+		entry = *indexed;
+		if(index_same_search(prev_index, searchstr))
+			lines = entry.matches;
+		else if(!pattern.is_regex && !pattern.literal_len)
+			// every line matches
+			lines = entry.lines;
+		else if(!pattern.is_regex && !index_may_contain(&entry, pattern.literal, pattern.literal_len))
+			lines = 0;
+		else
+			lines = scan_file(w, path, NULL);
+	}
+	else
+	{
+		entry.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		entry.size = st.st_size;
+		index_builder_init(&builder, &entry);
+		lines = scan_file(w, path, &builder);
+		index_builder_finish(&builder);
+		w->indexed++;
+	}
+	if(lines < 0)
+		// not indexed, looked at again next time
+		return 0;
+	entry.matches = lines;
+	if(!index_list_add(&w->index_list, path, &entry))
+		w->failed = true;
+	return lines;
+}
+
+static void process_dir(struct worker *w, const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+	size_t path_len = strlen(path);
+
+	if(!dir)
+		return;
+	while((entry = readdir(dir)) != NULL)
+	{
+		unsigned char type = entry->d_type;
+		char *child;
+		if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		if(type == DT_UNKNOWN)
+		{
+			struct stat st;
+			if(fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+		}
+		// symlinks, devices, fifos and sockets: neither find -type f nor grep -r
+		if(type != DT_DIR && type != DT_REG)
+			continue;
+		child = malloc(path_len + strlen(entry->d_name) + 2);
+		if(!child)
+		{
+			w->failed = true;
+			continue;
+		}
+		sprintf(child, "%s/%s", path, entry->d_name);
+		push_item(w, child, type == DT_DIR);
+	}
+	closedir(dir);
+}
+
+static void process_item(struct worker *w, struct item *item)
+{
+	if(item->is_dir)
+		process_dir(w, item->path);
+	else
+	{
+		size_t extra = count_newlines(item->path);
+		long lines = grep_file(w, item->path);
+		if(count_files)
+			w->files += 1 + extra;
+		// one "path:line" per match
+		w->lines += lines * (1 + extra);
+	}
+	free(item->path);
+}
+
+static void* worker_thread(void* thread_param)
+{
+	struct worker *w = (struct worker*)thread_param;
+	struct item item;
+	unsigned int i;
+	for(;;)
+	{
+		// read before looking at the deques, so a push after this wakes us
+		uint32_t seen = atomic_load(&work_seq);
+		bool found = deque_pop(&w->deque, &item, false);
+		// steal, starting with the next worker
+		for(i=1; !found && i<n_workers; i++)
+			found = deque_pop(&workers[(w->index + i) % n_workers].deque, &item, true);
+		if(found)
+		{
+			process_item(w, &item);
+			item_done();
+			continue;
+		}
+		if(atomic_load(&outstanding) == 0)
+			break;
+		// others are still walking, park until they push or finish
+		atomic_fetch_add(&idle, 1);
+		futex_wait(&work_seq, seen);
+		atomic_fetch_sub(&idle, 1);
+	}
+	return NULL;
+}
+
+int main(int argc, char**argv)
+{
+	const char *filesdir, *env;
+	struct index_list *lists;
+	struct timespec started;
+	struct stat st;
+	long files = 0, lines = 0, indexed = 0, listed = 0;
+	bool failed = false;
+	unsigned int i;
+	char *root;
+
+	if(argc < 3)
+		return 1;
+	filesdir = argv[1];
+	searchstr = argv[2];
+	if(stat(filesdir, &st) || !S_ISDIR(st.st_mode))
+		return 1;
+	// find doesn't follow a symlink given as starting point, grep -r does
+	if(!lstat(filesdir, &st) && S_ISLNK(st.st_mode))
+		count_files = false;
+
+	match_init();
+	pattern_ok = match_compile(&pattern, searchstr);
+	index_file = getenv("FINDER_INDEX");
+	if(index_file)
+	{
+		// before looking at any file, see index_lookup
+		clock_gettime(CLOCK_REALTIME, &started);
+		prev_index = index_load(index_file);
+	}
+
+	env = getenv("FINDER_THREADS");
+	n_workers = env ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+	if(n_workers < 1)
+		n_workers = 1;
+	workers = calloc(n_workers, sizeof(struct worker));
+	lists = calloc(n_workers, sizeof(struct index_list));
+	root = strdup(filesdir);
+	if(!workers || !lists || !root)
+		return 1;
+	for(i=0; i<n_workers; i++)
+	{
+		workers[i].index = i;
+		pthread_mutex_init(&workers[i].deque.lock, NULL);
+	}
+	push_item(&workers[0], root, true);
+	for(i=1; i<n_workers; i++)
+		if(pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]))
+			// the others (and this one) steal its share
+			workers[i].thread = 0;
+	worker_thread(&workers[0]);
+	for(i=0; i<n_workers; i++)
+	{
+		if(i && workers[i].thread)
+			pthread_join(workers[i].thread, NULL);
+		files += workers[i].files;
+		lines += workers[i].lines;
+		failed |= workers[i].failed;
+		free(workers[i].deque.items);
+		lists[i] = workers[i].index_list;
+		indexed += workers[i].indexed;
+		listed += lists[i].count;
+	}
+	free(workers);
+	if(failed)
+	{
+		fprintf(stderr, "finder: out of memory, counts incomplete\n");
+		return 1;
+	}
+	// nothing new to write if no file changed, came or went
+	if(index_file && pattern_ok && (indexed || (size_t)listed != index_size(prev_index)
+			|| !index_same_search(prev_index, searchstr)) && !index_save(index_file, searchstr,
+			started.tv_sec * 1000000000LL + started.tv_nsec, lists, n_workers))
+		// the counts are still right
+		fprintf(stderr, "finder: failed to write index %s: %s\n", index_file, strerror(errno));
+	for(i=0; i<n_workers; i++)
+		index_list_free(&lists[i]);
+	free(lists);
+	index_free(prev_index);
+
+	printf("The number of files are %ld and the number of matching lines are %ld\n", files, lines);
+	return 0;
+}
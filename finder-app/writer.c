@@ -1,37 +1,250 @@
+#define _GNU_SOURCE // O_DIRECT, getdelim
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <syslog.h>
 
-int main(int argc, char**argv)
+/*
+	usage:
+	  writer <file> <string>
+	  writer [-m buffered|direct|sync] [-0] <file> <string> [<file> <string> ...]
+	  writer [-m buffered|direct|sync] [-0] -
+	The last form reads the pairs from stdin, one "<file>\t<string>" per line,
+	or "<file>\0<string>\0" with -0 (strings may then hold anything).
+	Two arguments are always the first form, even "-0 -" (writes "-" to the
+	file "-0"): use "-0 -- -" for NUL-separated stdin.
+
+	Write modes:
+	  buffered: one write() per file (default)
+	  direct:   O_DIRECT from an aligned buffer, bypassing the page cache
+	  sync:     like buffered, with one fdatasync per file every SYNC_BATCH files
+*/
+
+#define DIRECT_ALIGN 4096
+// files kept open before syncing them all
+#define SYNC_BATCH 64
+
+enum write_mode { MODE_BUFFERED, MODE_DIRECT, MODE_SYNC };
+
+static enum write_mode mode = MODE_BUFFERED;
+// files written in sync mode and not synced yet
+static int pending_fds[SYNC_BATCH];
+static int n_pending;
+// O_DIRECT buffer, grown as needed
+static char *direct_buf;
+static size_t direct_size;
+
+static int write_all(int fd, const char *buf, size_t len)
 {
-	openlog(NULL, 0, LOG_USER);
-	if(argc != 3)
+	while(len)
 	{
-		syslog(LOG_ERR, "arguments not specified\n");
-		return 1;
+		ssize_t n = write(fd, buf, len);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
 	}
-	char *fname = argv[1];
-	char *string = argv[2];
+	return 0;
+}
+
+static int sync_pending(void)
+{
+	int ret = 0, i;
+	for(i=0; i<n_pending; i++)
+	{
+		if(fdatasync(pending_fds[i]))
+		{
+			syslog(LOG_ERR, "failed to sync: %m\n");
+			ret = -1;
+		}
+		close(pending_fds[i]);
+	}
+	n_pending = 0;
+	return ret;
+}
+
+/*
+	O_DIRECT needs aligned sizes: write whole blocks, then cut the file
+	back to the string length
+*/
+static int write_direct(int fd, const char *string, size_t len)
+{
+	size_t size = (len + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+	if(size > direct_size)
+	{
+		free(direct_buf);
+		direct_buf = NULL;
+		direct_size = 0;
+		if(posix_memalign((void**)&direct_buf, DIRECT_ALIGN, size))
+			return -1;
+		direct_size = size;
+	}
+	memcpy(direct_buf, string, len);
+	memset(direct_buf + len, 0, size - len);
+	if(write_all(fd, direct_buf, size))
+		return -1;
+	return ftruncate(fd, len);
+}
+
+static int write_file(const char *fname, const char *string, size_t len)
+{
+	int flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+	int fd = -1;
+	bool direct = false;
 
 	syslog(LOG_DEBUG, "Writing %s to %s\n", string, fname);
-	FILE *f = fopen(fname, "w");
-	if(!f)
+	if(mode == MODE_DIRECT)
+	{
+		fd = open(fname, flags|O_DIRECT, 0644);
+		direct = fd >= 0;
+		if(fd < 0 && errno == EINVAL)
+			// filesystem without O_DIRECT (tmpfs...), write it normally
+			syslog(LOG_WARNING, "no O_DIRECT for %s\n", fname);
+	}
+	if(fd < 0)
+		fd = open(fname, flags, 0644);
+	if(fd < 0)
 	{
 		syslog(LOG_ERR, "failed to open %s\n", fname);
-		return 1;
+		return -1;
 	}
-
-	if(fputs(string, f) == EOF)
+	if(direct ? write_direct(fd, string, len) : write_all(fd, string, len))
 	{
 		syslog(LOG_ERR, "failed to write to %s\n", fname);
-		return 1;
+		close(fd);
+		return -1;
 	}
-
-	if(fclose(f) == EOF)
+	if(mode == MODE_SYNC)
+	{
+		pending_fds[n_pending++] = fd;
+		if(n_pending == SYNC_BATCH)
+			return sync_pending();
+		return 0;
+	}
+	if(close(fd))
 	{
 		syslog(LOG_ERR, "failed to close file\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Pairs from stdin, see usage above
+*/
+static int write_stdin(int delim)
+{
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	int ret = 0;
+
+	while((len = getdelim(&line, &capacity, delim, stdin)) > 0)
+	{
+		char *string;
+		if(line[len - 1] == delim)
+			line[--len] = '\0';
+		if(delim == '\0')
+		{
+			// the string is the next record
+			char *fname = strdup(line);
+			if(!fname)
+			{
+				ret = -1;
+				break;
+			}
+			len = getdelim(&line, &capacity, delim, stdin);
+			if(len < 0)
+			{
+				syslog(LOG_ERR, "no string for %s\n", fname);
+				free(fname);
+				ret = -1;
+				break;
+			}
+			if(len && line[len - 1] == delim)
+				len--;
+			if(write_file(fname, line, len))
+				ret = -1;
+			free(fname);
+			continue;
+		}
+		string = memchr(line, '\t', len);
+		if(!string)
+		{
+			syslog(LOG_ERR, "no string for %s\n", line);
+			ret = -1;
+			continue;
+		}
+		*string++ = '\0';
+		if(write_file(line, string, line + len - string))
+			ret = -1;
+	}
+	free(line);
+	return ret;
+}
+
+int main(int argc, char**argv)
+{
+	int opt, delim = '\n', ret = 0, i;
+
+	openlog(NULL, 0, LOG_USER);
+	// the original form, whatever the file and string look like
+	if(argc == 3)
+		return write_file(argv[1], argv[2], strlen(argv[2])) ? 1 : 0;
+	// '+': options only before the first pair
+	while((opt = getopt(argc, argv, "+m:0")) != -1)
+	{
+		switch(opt)
+		{
+			case 'm':
+				if(!strcmp(optarg, "buffered"))
+					mode = MODE_BUFFERED;
+				else if(!strcmp(optarg, "direct"))
+					mode = MODE_DIRECT;
+				else if(!strcmp(optarg, "sync"))
+					mode = MODE_SYNC;
+				else
+				{
+					syslog(LOG_ERR, "unknown mode %s\n", optarg);
+					return 1;
+				}
+				break;
+			case '0':
+				delim = '\0';
+				break;
+			default:
+				syslog(LOG_ERR, "arguments not specified\n");
+				return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if(argc == 1 && !strcmp(argv[0], "-"))
+		ret = write_stdin(delim);
+	else if(argc >= 2 && argc % 2 == 0)
+	{
+		for(i=0; i<argc; i+=2)
+			if(write_file(argv[i], argv[i+1], strlen(argv[i+1])))
+				ret = -1;
+	}
+	else
+	{
+		syslog(LOG_ERR, "arguments not specified\n");
 		return 1;
 	}
+	if(sync_pending())
+		ret = -1;
+	free(direct_buf);
 
 	// all good then
-	return 0;
+	return ret ? 1 : 0;
 }
@@ -0,0 +1,453 @@
+/**
+ * @file aesd-circular-buffer-fuzz.c
+ * @brief Differential fuzzer for aesd-circular-buffer.c and aesd-circular-buffer-lf.c
+ *
+ * Each input is decoded as a list of operations (add, find, get by number,
+ * length, reset) applied to both circular buffers and to a plain reference
+ * model, any difference aborts.  Entry sizes go up to 2^40 so positions
+ * far past 32 bits are covered; entries are never dereferenced.
+ *
+ * With -DAESD_FUZZ_LIBFUZZER and -fsanitize=fuzzer, only LLVMFuzzerTestOneInput
+ * is built.  Otherwise:
+ *
+ *  aesd-circular-buffer-fuzz [-n iterations] [-s seed] [file...]
+ *      runs random inputs (or replays the given files)
+ *  aesd-circular-buffer-fuzz -t consumers [-n entries]
+ *      one producer and several lock-free consumers on the lock-free
+ *      buffer, checking every snapshot against the known history; the
+ *      producer waits for one snapshot every few entries, so it can't
+ *      finish before the consumers ran (fails if none was checked)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-circular-buffer-lf.h"
+
+#define MAX_ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+#define CHECK(cond, ...) do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            abort(); \
+        } \
+    } while(0)
+
+/*
+    Reference model: the entries stored, oldest first, and the bytes evicted
+*/
+struct model
+{
+    struct aesd_buffer_entry entry[MAX_ENTRIES];
+    uint8_t count;
+    unsigned long long base_offs;
+};
+
+static void model_add(struct model *model, const struct aesd_buffer_entry *add, char **evicted)
+{
+    *evicted = NULL;
+    if(model->count == MAX_ENTRIES)
+    {
+        *evicted = model->entry[0].buffptr;
+        model->base_offs += model->entry[0].size;
+        memmove(model->entry, model->entry + 1, sizeof(model->entry[0]) * (MAX_ENTRIES - 1));
+        model->count--;
+    }
+    model->entry[model->count++] = *add;
+}
+
+/**
+ * @return the index of the entry holding @param offset (relative to the oldest byte), or -1
+ */
+static int model_find(struct model *model, unsigned long long offset, size_t *entry_offset)
+{
+    uint8_t i;
+    for(i=0; i<model->count; i++)
+    {
+        if(offset < model->entry[i].size)
+        {
+            *entry_offset = offset;
+            return i;
+        }
+        offset -= model->entry[i].size;
+    }
+    return -1;
+}
+
+static unsigned long long model_len(struct model *model)
+{
+    unsigned long long len = 0;
+    uint8_t i;
+    for(i=0; i<model->count; i++)
+        len += model->entry[i].size;
+    return len;
+}
+
+/*
+    Input decoding, missing bytes read as zero
+*/
+struct input
+{
+    const uint8_t *data;
+    size_t size;
+};
+
+static uint64_t input_take(struct input *in, unsigned int bytes)
+{
+    uint64_t value = 0;
+    unsigned int i;
+    for(i=0; i<bytes; i++)
+    {
+        value |= (uint64_t)(in->size ? *in->data : 0) << (8 * i);
+        if(in->size)
+        {
+            in->data++;
+            in->size--;
+        }
+    }
+    return value;
+}
+
+static void check_equal(struct model *model, struct aesd_circular_buffer *buffer, struct aesd_circular_buffer_lf *lf)
+{
+    struct aesd_buffer_entry entries[MAX_ENTRIES];
+    unsigned long long start;
+    uint8_t i, count;
+
+    CHECK(aesd_circular_buffer_count(buffer) == model->count, "count %u, model %u", aesd_circular_buffer_count(buffer), model->count);
+    CHECK(buffer->full == (model->count == MAX_ENTRIES), "full %d, model count %u", buffer->full, model->count);
+    CHECK(buffer->base_offs == model->base_offs, "base_offs %llu, model %llu", buffer->base_offs, model->base_offs);
+    CHECK(aesd_circular_buffer_len(buffer) == model_len(model), "len %llu, model %llu", aesd_circular_buffer_len(buffer), model_len(model));
+
+    count = aesd_circular_buffer_lf_snapshot(lf, entries, &start);
+    CHECK(count == model->count, "lf count %u, model %u", count, model->count);
+    CHECK(aesd_circular_buffer_lf_count(lf) == model->count, "lf count %u, model %u", aesd_circular_buffer_lf_count(lf), model->count);
+    CHECK(!count || start == model->base_offs, "lf start %llu, model %llu", start, model->base_offs);
+    for(i=0; i<count; i++)
+        CHECK(entries[i].buffptr == model->entry[i].buffptr && entries[i].size == model->entry[i].size, "lf entry %u differs", i);
+}
+
+static void check_find(struct model *model, struct aesd_circular_buffer *buffer, struct aesd_circular_buffer_lf *lf, unsigned long long offset)
+{
+    size_t model_offset = 0, offset_rtn = 0, lf_offset_rtn = 0;
+    int index = model_find(model, offset, &model_offset);
+    struct aesd_buffer_entry *entry, lf_entry;
+    bool found;
+
+    // the locked buffer takes a size_t, skip what it can't express
+    if(offset == (size_t)offset)
+    {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &offset_rtn);
+        if(index < 0)
+            CHECK(entry == NULL, "found offset %llu, model didn't", offset);
+        else
+        {
+            CHECK(entry != NULL, "didn't find offset %llu, model has entry %d", offset, index);
+            CHECK(entry->buffptr == model->entry[index].buffptr && offset_rtn == model_offset,
+                "offset %llu: wrong entry or offset %zu (model %zu)", offset, offset_rtn, model_offset);
+        }
+    }
+    // the lock-free one takes absolute positions
+    found = aesd_circular_buffer_lf_find_entry_offset_for_fpos(lf, model->base_offs + offset, &lf_entry, &lf_offset_rtn);
+    CHECK(found == (index >= 0), "lf found=%d for offset %llu, model index %d", found, offset, index);
+    if(found)
+        CHECK(lf_entry.buffptr == model->entry[index].buffptr && lf_offset_rtn == model_offset,
+            "lf offset %llu: wrong entry or offset", offset);
+    // positions before the oldest byte are gone
+    if(model->base_offs)
+        CHECK(!aesd_circular_buffer_lf_find_entry_offset_for_fpos(lf, model->base_offs - 1, &lf_entry, &lf_offset_rtn),
+            "lf found evicted position %llu", model->base_offs - 1);
+}
+
+static void check_get_entry_no(struct model *model, struct aesd_circular_buffer *buffer, int index)
+{
+    unsigned long long entry_offset = 0, expected = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_no(buffer, index, &entry_offset);
+    int i;
+    if(index < 0 || index >= model->count)
+    {
+        CHECK(entry == NULL, "got entry number %d of %u", index, model->count);
+        return;
+    }
+    for(i=0; i<index; i++)
+        expected += model->entry[i].size;
+    CHECK(entry != NULL, "no entry number %d of %u", index, model->count);
+    CHECK(entry->buffptr == model->entry[index].buffptr && entry_offset == expected,
+        "entry number %d: offset %llu, model %llu", index, entry_offset, expected);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct aesd_circular_buffer buffer;
+    static struct aesd_circular_buffer_lf lf;
+    struct input in = {data, size};
+    struct model model = {0};
+    uintptr_t next_ptr = 0x1000;
+
+    aesd_circular_buffer_init(&buffer);
+    aesd_circular_buffer_lf_init(&lf);
+    while(in.size)
+    {
+        uint8_t op = input_take(&in, 1);
+        switch(op % 5)
+        {
+            case 0:
+            case 1:
+            {
+                // add, mostly small entries, some huge ones
+                struct aesd_buffer_entry add;
+                char *evicted, *model_evicted, *lf_evicted;
+                uint64_t size = input_take(&in, 2);
+                if(op & 0x80)
+                    size <<= 24;
+                // fake pointers, unique per entry and never dereferenced
+                add.buffptr = (char *)next_ptr;
+                add.size = size;
+                next_ptr += 0x10;
+                model_add(&model, &add, &model_evicted);
+                evicted = aesd_circular_buffer_add_entry(&buffer, &add);
+                lf_evicted = aesd_circular_buffer_lf_add_entry(&lf, &add);
+                CHECK(evicted == model_evicted, "evicted %p, model %p", (void *)evicted, (void *)model_evicted);
+                CHECK(lf_evicted == model_evicted, "lf evicted %p, model %p", (void *)lf_evicted, (void *)model_evicted);
+            }
+            break;
+            case 2:
+            {
+                // find, around every entry boundary and past the end
+                unsigned long long len = model_len(&model);
+                unsigned long long offset = input_take(&in, 8);
+                if(!(op & 0x80))
+                    offset %= len + 2;
+                check_find(&model, &buffer, &lf, offset);
+            }
+            break;
+            case 3:
+                check_get_entry_no(&model, &buffer, (int8_t)input_take(&in, 1));
+            break;
+            case 4:
+                if(op & 0x80)
+                {
+                    memset(&model, 0, sizeof(model));
+                    aesd_circular_buffer_init(&buffer);
+                    aesd_circular_buffer_lf_init(&lf);
+                }
+            break;
+        }
+        check_equal(&model, &buffer, &lf);
+    }
+    return 0;
+}
+
+#ifndef AESD_FUZZ_LIBFUZZER
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// entries added per snapshot checked, at most
+#define STRESS_ADDS_PER_CHECK 8
+
+/*
+    Multi-threaded mode: entry number i has a known size and pointer, so
+    consumers can check every snapshot against the history on their own
+*/
+static unsigned long long *stress_pos;
+static unsigned long stress_entries;
+static atomic_bool stress_done;
+// snapshots checked by all the consumers so far
+static atomic_ulong stress_checks;
+
+static size_t stress_size(unsigned long i)
+{
+    return (i * 2654435761u) % 97 + 1;
+}
+
+static char *stress_ptr(unsigned long i)
+{
+    return (char *)(uintptr_t)((i + 1) * 0x10);
+}
+
+static void *stress_producer(void *arg)
+{
+    struct aesd_circular_buffer_lf *lf = arg;
+    unsigned long i;
+    for(i=0; i<stress_entries; i++)
+    {
+        struct aesd_buffer_entry add = {.buffptr = stress_ptr(i), .size = stress_size(i)};
+        char *evicted;
+        // don't run away from the consumers (on a single CPU it would
+        // add everything within one time slice)
+        while(atomic_load_explicit(&stress_checks, memory_order_relaxed) < i / STRESS_ADDS_PER_CHECK)
+            sched_yield();
+        evicted = aesd_circular_buffer_lf_add_entry(lf, &add);
+        CHECK(evicted == (i >= MAX_ENTRIES ? stress_ptr(i - MAX_ENTRIES) : NULL), "producer evicted the wrong entry");
+    }
+    atomic_store(&stress_done, true);
+    return NULL;
+}
+
+static void *stress_consumer(void *arg)
+{
+    struct aesd_circular_buffer_lf *lf = arg;
+    unsigned long long seed = (uintptr_t)&seed, checks = 0;
+    bool done;
+    // one more once the producer is done, so there is always one
+    do
+    {
+        struct aesd_buffer_entry entries[MAX_ENTRIES], entry;
+        unsigned long long start, pos, end;
+        unsigned long first;
+        size_t offset;
+        uint8_t i, count;
+        done = atomic_load(&stress_done);
+        count = aesd_circular_buffer_lf_snapshot(lf, entries, &start);
+        if(!count)
+            continue;
+        first = (uintptr_t)entries[0].buffptr / 0x10 - 1;
+        CHECK(start == stress_pos[first], "snapshot of entry %lu starts at %llu, not %llu", first, start, stress_pos[first]);
+        for(i=0; i<count; i++)
+            CHECK(entries[i].buffptr == stress_ptr(first + i) && entries[i].size == stress_size(first + i),
+                "snapshot entry %u isn't entry %lu", i, first + i);
+        CHECK(count == MAX_ENTRIES || first == 0, "snapshot of %u entries from entry %lu", count, first);
+        // a random position of that snapshot, may have been evicted since
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        end = stress_pos[first + count];
+        pos = start + (seed >> 33) % (end - start);
+        if(aesd_circular_buffer_lf_find_entry_offset_for_fpos(lf, pos, &entry, &offset))
+        {
+            unsigned long n = (uintptr_t)entry.buffptr / 0x10 - 1;
+            CHECK(n >= first && stress_pos[n] + offset == pos && offset < stress_size(n),
+                "position %llu found in entry %lu at offset %zu", pos, n, offset);
+        }
+        checks++;
+        atomic_fetch_add_explicit(&stress_checks, 1, memory_order_relaxed);
+    } while(!done);
+    return (void *)(uintptr_t)checks;
+}
+
+static int stress(int consumers, unsigned long entries)
+{
+    static struct aesd_circular_buffer_lf lf;
+    pthread_t producer, *threads = calloc(consumers, sizeof(pthread_t));
+    unsigned long long checks = 0;
+    unsigned long i;
+    int t;
+
+    stress_entries = entries;
+    stress_pos = malloc(sizeof(unsigned long long) * (entries + 1));
+    if(!threads || !stress_pos)
+    {
+        perror("malloc");
+        return 1;
+    }
+    stress_pos[0] = 0;
+    for(i=0; i<entries; i++)
+        stress_pos[i + 1] = stress_pos[i] + stress_size(i);
+    aesd_circular_buffer_lf_init(&lf);
+    for(t=0; t<consumers; t++)
+        if(pthread_create(&threads[t], NULL, stress_consumer, &lf))
+        {
+            fprintf(stderr, "failed to start consumer %d\n", t);
+            return 1;
+        }
+    if(pthread_create(&producer, NULL, stress_producer, &lf))
+    {
+        fprintf(stderr, "failed to start the producer\n");
+        return 1;
+    }
+    pthread_join(producer, NULL);
+    for(t=0; t<consumers; t++)
+    {
+        void *ret;
+        pthread_join(threads[t], &ret);
+        checks += (uintptr_t)ret;
+    }
+    printf("%lu entries, %d consumers, %llu snapshots checked\n", entries, consumers, checks);
+    free(stress_pos);
+    free(threads);
+    // nothing was tested
+    if(!checks)
+    {
+        fprintf(stderr, "no snapshot checked\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int replay(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    uint8_t *data = NULL;
+    size_t size = 0, capacity = 0, n;
+    if(!file)
+    {
+        perror(path);
+        return 1;
+    }
+    do
+    {
+        if(size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            data = realloc(data, capacity);
+            if(!data)
+            {
+                perror("realloc");
+                fclose(file);
+                return 1;
+            }
+        }
+        n = fread(data + size, 1, capacity - size, file);
+        size += n;
+    } while(n);
+    fclose(file);
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 100000, i;
+    unsigned int seed = 1;
+    int opt, consumers = 0;
+    uint8_t data[512];
+
+    while((opt = getopt(argc, argv, "n:s:t:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': iterations = strtoul(optarg, NULL, 0); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 't': consumers = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations] [-s seed] [-t consumers] [file...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(consumers > 0)
+        return stress(consumers, iterations);
+    if(optind < argc)
+    {
+        for(; optind < argc; optind++)
+            if(replay(argv[optind]))
+                return 1;
+        return 0;
+    }
+    srand(seed);
+    for(i=0; i<iterations; i++)
+    {
+        size_t size = rand() % sizeof(data), j;
+        for(j=0; j<size; j++)
+            data[j] = rand();
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    printf("%lu random inputs, seed %u\n", iterations, seed);
+    return 0;
+}
+#endif
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Run an aesdsocket binary under aesdsocket-load and stop it cleanly
+# (SIGTERM, so an instrumented build writes its profile)
+# usage: aesdsocket-bench.sh <aesdsocket binary> [aesdsocket-load options]
+
+test $# -lt 1 && echo "usage: $0 <aesdsocket> [aesdsocket-load options]" && exit 1
+
+bin=$1
+shift
+load=${AESDSOCKET_LOAD:-$(dirname "$0")/aesdsocket-load}
+
+"$bin" &
+pid=$!
+"$load" -w 5 "$@"
+status=$?
+kill -TERM $pid
+wait $pid || status=$?
+
+exit $status
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+
+/*
+	Load generator for aesdsocket: clients in parallel, each sending
+	packets one connection at a time (as the server expects) and reading
+	the reply up to the server closing it.
+
+	usage: aesdsocket-load [-a addr] [-p port] [-c clients] [-n packets]
+	                       [-s size] [-w seconds]
+
+	Prints one line:
+	  packets=... errors=... seconds=... packets/s=... p50_us=... p99_us=... bytes=...
+	An error is a failed connection, or a reply without the packet sent.
+*/
+
+struct client {
+	pthread_t tid;
+	int index;
+	// latencies of each packet, in us
+	long *latency;
+	int errors;
+	unsigned long long bytes;
+};
+
+static struct sockaddr_in server_addr;
+static int n_packets = 100;
+static int packet_size = 64;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while(len)
+	{
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+	Send @param packet, read the whole reply
+	@return 0 if the reply holds the packet
+*/
+static int do_packet(struct client *c, const char *packet, size_t len, char **reply, size_t *capacity)
+{
+	size_t used = 0;
+	ssize_t n = 0;
+	int fd = socket(PF_INET, SOCK_STREAM, 0), one = 1;
+
+	if(fd < 0)
+		return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) || send_all(fd, packet, len))
+	{
+		close(fd);
+		return -1;
+	}
+	for(;;)
+	{
+		if(*capacity - used < 4096)
+		{
+			char *larger = realloc(*reply, *capacity * 2);
+			if(!larger)
+				break;
+			*reply = larger;
+			*capacity *= 2;
+		}
+		n = recv(fd, *reply + used, *capacity - used, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		used += n;
+	}
+	close(fd);
+	c->bytes += used;
+	if(n < 0)
+		return -1;
+	// the whole history comes back, ours included
+	return memmem(*reply, used, packet, len) ? 0 : -1;
+}
+
+static void* client_thread(void* thread_param)
+{
+	struct client *c = (struct client*)thread_param;
+	size_t capacity = 64 * 1024;
+	char *reply = malloc(capacity);
+	char *packet = malloc(packet_size + 64);
+	int i;
+
+	if(!reply || !packet)
+	{
+		c->errors = n_packets;
+		goto _fini;
+	}
+	for(i=0; i<n_packets; i++)
+	{
+		// unique, so it can be found in the reply
+		int len = snprintf(packet, 64, "load %d %d ", c->index, i);
+		long long start;
+		memset(packet + len, 'x', packet_size > len ? packet_size - len : 0);
+		len = packet_size > len ? packet_size : len;
+		packet[len++] = '\n';
+		start = now_us();
+		if(do_packet(c, packet, len, &reply, &capacity))
+			c->errors++;
+		c->latency[i] = now_us() - start;
+	}
+_fini:
+	free(packet);
+	free(reply);
+	return NULL;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long*)a, y = *(const long*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+	Retry connecting until the server listens, for up to @param seconds
+*/
+static int wait_server(int seconds)
+{
+	long long deadline = now_us() + seconds * 1000000LL;
+	for(;;)
+	{
+		int fd = socket(PF_INET, SOCK_STREAM, 0);
+		if(fd < 0)
+			return -1;
+		// a connection without a packet: the server reads nothing and closes it
+		if(!connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)))
+		{
+			shutdown(fd, SHUT_WR);
+			close(fd);
+			return 0;
+		}
+		close(fd);
+		if(now_us() > deadline)
+			return -1;
+		usleep(20000);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *addr = "127.0.0.1";
+	int port = 9000, n_clients = 4, wait_seconds = 0, opt, i, errors = 0;
+	unsigned long long bytes = 0;
+	struct client *clients;
+	long *latency;
+	long long start, elapsed;
+	size_t total;
+
+	while((opt = getopt(argc, argv, "a:p:c:n:s:w:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'a': addr = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': n_clients = atoi(optarg); break;
+			case 'n': n_packets = atoi(optarg); break;
+			case 's': packet_size = atoi(optarg); break;
+			case 'w': wait_seconds = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-a addr] [-p port] [-c clients] [-n packets] [-s size] [-w seconds]\n", *argv);
+				return 1;
+		}
+	}
+	if(n_clients < 1 || n_packets < 1 || packet_size < 1)
+	{
+		fprintf(stderr, "clients, packets and size must be positive\n");
+		return 1;
+	}
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, addr, &server_addr.sin_addr) != 1)
+	{
+		fprintf(stderr, "invalid address %s\n", addr);
+		return 1;
+	}
+	if(wait_seconds && wait_server(wait_seconds))
+	{
+		fprintf(stderr, "no server on %s:%d\n", addr, port);
+		return 1;
+	}
+
+	total = (size_t)n_clients * n_packets;
+	clients = calloc(n_clients, sizeof(struct client));
+	latency = calloc(total, sizeof(long));
+	if(!clients || !latency)
+	{
+		fprintf(stderr, "failed to allocate memory\n");
+		return 1;
+	}
+	start = now_us();
+	for(i=0; i<n_clients; i++)
+	{
+		clients[i].index = i;
+		clients[i].latency = latency + (size_t)i * n_packets;
+		if(pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]))
+		{
+			fprintf(stderr, "failed to start client %d\n", i);
+			return 1;
+		}
+	}
+	for(i=0; i<n_clients; i++)
+	{
+		pthread_join(clients[i].tid, NULL);
+		errors += clients[i].errors;
+		bytes += clients[i].bytes;
+	}
+	elapsed = now_us() - start;
+
+	qsort(latency, total, sizeof(long), compare_long);
+	printf("packets=%zu errors=%d seconds=%.3f packets/s=%.1f p50_us=%ld p99_us=%ld bytes=%llu\n",
+		total, errors, elapsed / 1e6, total / (elapsed / 1e6),
+		latency[total / 2], latency[total * 99 / 100], bytes);
+	free(latency);
+	free(clients);
+	return errors ? 1 : 0;
+}
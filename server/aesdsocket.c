@@ -199,6 +199,13 @@ void * _do_thread(void *data)
 				syslog(LOG_ERR, "failed to acquire mutex: %s", strerror(r));
 				goto _fini_file;
 			}
+			// the append left the offset at the end
+			if(lseek(file_fd, 0, SEEK_SET) < 0)
+			{
+				syslog(LOG_ERR, "failed to seek file: %s", strerror(errno));
+				pthread_mutex_unlock(td->mutex);	// don't log errors
+				goto _fini_file;
+			}
 #endif
 			// reuse buffer
 			// change to `pread`
@@ -452,7 +459,9 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if(listen(server_fd, 1))
+	// a backlog of 1 drops the SYNs of clients connecting at the same time,
+	// and they only retry after the 1s initial retransmission timeout
+	if(listen(server_fd, SOMAXCONN))
 	{
 		syslog(LOG_ERR, "failed to listen on socket: %s", strerror(errno));
 		close(server_fd);